@@ -23,6 +23,9 @@ Application::Application(const char* caption, int width, int height)
 
 Application::~Application()
 {
+    // The registry deletes the images when the app goes away
+    for (size_t i = 0; i < textures.size(); ++i)
+        images.Release(textures[i]);
 }
 
 void Application::Init(void)
@@ -37,6 +40,7 @@ void Application::Init(void)
     
     zbuffer = new FloatImage();
     zbuffer->Resize(window_width, window_height);
+    zbuffer->EnableHiZ(useHiZ);
 
 
     // Load UI icons (stored inside /res/images)
@@ -100,12 +104,30 @@ void Application::Init(void)
     // we adjusted to 0.8 so that when you zoom you still see the shape correctly
     single->model.MakeTranslationMatrix(0.0f, 0.8f, 0.0f);
     
+    // Triangle reordering for the vertex cache and overdraw, done once by LoadOBJ and kept in the mesh cache (toggle optimizeMeshes)
+    // The levels of detail are only built if the entities start using them (E switches between the ones loaded here)
+    sMeshLoadOptions meshOptions;
+    meshOptions.optimizeOrder = optimizeMeshes;
+    meshOptions.buildLODs = useLODs;
+
     // use lee text/mesh for single
     Mesh* lee_mesh = new Mesh();
-    lee_mesh->LoadOBJ("meshes/lee.obj");
+    lee_mesh->LoadOBJ("meshes/lee.obj", meshOptions);
     single->mesh = lee_mesh;
-    Image* tex_lee = new Image();
-    tex_lee->LoadTGA("textures/lee_color_specular.tga", true);
+    // Textures come from the registry (loaded once per path), with mipmaps since distant entities sample the smaller levels
+    images.SetBudget(textureBudget);
+    sImageLoadOptions texOptions;
+    texOptions.swizzled = swizzleTextures;
+    texOptions.compressed = compressTextures;
+    // A texture that can't be loaded is NULL (the entities using it are drawn untextured) and is not kept in the list
+    auto acquireTexture = [&](const char* filename)
+    {
+        Image* image = images.Acquire(filename, texOptions);
+        if (image)
+            textures.push_back(image);
+        return image;
+    };
+    Image* tex_lee = acquireTexture("textures/lee_color_specular.tga");
     single->texture = tex_lee;
 
     //MULTIPLE ENTITIES
@@ -128,10 +150,9 @@ void Application::Init(void)
     
     // use anna mesh and text for second entity
     Mesh* mesh_anna = new Mesh();
-    mesh_anna->LoadOBJ("meshes/anna.obj");
+    mesh_anna->LoadOBJ("meshes/anna.obj", meshOptions);
     e2->mesh = mesh_anna;
-    Image* tex_anna = new Image();
-    tex_anna->LoadTGA("textures/anna_color_specular.tga", true);
+    Image* tex_anna = acquireTexture("textures/anna_color_specular.tga");
     e2->texture = tex_anna;
 
     
@@ -143,10 +164,9 @@ void Application::Init(void)
     
     //use cleo mesh/text for third entity
     Mesh* mesh_cleo = new Mesh();
-    mesh_cleo->LoadOBJ("meshes/cleo.obj");
+    mesh_cleo->LoadOBJ("meshes/cleo.obj", meshOptions);
     e3->mesh = mesh_cleo;
-    Image* tex_cleo = new Image();
-    tex_cleo->LoadTGA("textures/cleo_color_specular.tga", true);
+    Image* tex_cleo = acquireTexture("textures/cleo_color_specular.tga");
     e3->texture = tex_cleo;
     
     // Camera init, set the values
@@ -193,6 +213,12 @@ void Application::Render()
         e->useTexture = useTexture;
         e->useZBuffer = useZBuffer;
         e->interpolateUV = interpolateUV;
+        e->cullFrustum = cullFrustum;
+        e->cullClusters = cullClusters;
+        e->useLODs = useLODs;
+        e->cullBackFaces = cullBackFaces;
+        e->cullSmallTriangles = cullSmallTriangles;
+        e->sampler = sampler;
 
         if (wireframe)
             e->mode = Entity::eRenderMode::WIREFRAME;
@@ -209,18 +235,29 @@ void Application::Render()
 
     FloatImage* zb = useZBuffer ? zbuffer : NULL;
 
+    // With binning the entities only submit triangles, they are rasterized in parallel on Flush
+    Rasterizer* binner = useBinning ? &rasterizer : NULL;
+    if (binner)
+    {
+        binner->useVisibilityBuffer = useVisibilityBuffer;
+        binner->Begin(&framebuffer, zb);
+    }
+
     // Now control the change between modes and render what we want
     if (mode == 1) // single entity
     {
-        if (single) single->Render(&framebuffer, &camera, zb);
+        if (single) single->Render(&framebuffer, &camera, zb, binner);
     }
     else if (mode == 2) // multiple entities
     {
-        if (e1) e1->Render(&framebuffer, &camera, zb);
-        if (e2) e2->Render(&framebuffer, &camera, zb);
-        if (e3) e3->Render(&framebuffer, &camera, zb);
+        if (e1) e1->Render(&framebuffer, &camera, zb, binner);
+        if (e2) e2->Render(&framebuffer, &camera, zb, binner);
+        if (e3) e3->Render(&framebuffer, &camera, zb, binner);
     }
 
+    if (binner)
+        binner->Flush();
+
     framebuffer.Render();
 }
 
@@ -228,6 +265,16 @@ void Application::Render()
 // Called after render
 void Application::Update(float seconds_elapsed)
 {
+    if (showStats)
+    {
+        stats_timer += seconds_elapsed;
+        if (stats_timer >= 1.0f)
+        {
+            PrintStats();
+            stats_timer = 0.0f;
+        }
+    }
+
     if (mode == 2)  // just update the multiple entities, the single one is not rotating
     {
         if (e1) e1->Update(seconds_elapsed);
@@ -236,6 +283,49 @@ void Application::Update(float seconds_elapsed)
     }
 }
 
+// Counters of the last rendered frame
+void Application::PrintStats()
+{
+    // Culling counters of the entities drawn in the current mode
+    sCullStats cs;
+    if (mode == 1)
+    {
+        if (single) cs.Add(single->cullStats);
+    }
+    else if (mode == 2)
+    {
+        if (e1) cs.Add(e1->cullStats);
+        if (e2) cs.Add(e2->cullStats);
+        if (e3) cs.Add(e3->cullStats);
+    }
+    std::cout << "Culling: " << cs.outside_frustum << " of " << cs.entities << " entities outside the frustum, "
+              << cs.lod_triangles_skipped << " triangles left out by the LODs, "
+              << cs.clusters_outside_frustum << " + " << cs.clusters_back_facing << " of " << cs.clusters << " meshlets outside / back facing, "
+              << cs.vertices << " vertices transformed, " << cs.triangles << " triangles, "
+              << cs.backfaces << " back faces, "
+              << cs.small_triangles << " without pixel centers" << std::endl;
+
+    std::cout << "Textures: " << images.GetNumImages() << " images, "
+              << images.GetResidentBytes() / 1024 << " KB resident (budget " << images.GetBudget() / 1024 << " KB), "
+              << images.hits << " hits, " << images.loads << " loads, " << images.evictions << " evictions"
+              << (compressTextures ? " (block compressed)" : "") << std::endl;
+
+    if (!useBinning)
+    {
+        std::cout << "Stats are collected by the tile rasterizer, enable it with B" << std::endl;
+        return;
+    }
+
+    const sRasterStats& rs = rasterizer.GetStats();
+    std::cout << "Raster (" << rasterizer.GetNumThreads() << " threads): "
+              << rs.triangles << " triangles, "
+              << rs.fragments << " fragments, "
+              << rs.shaded << " shaded, "
+              << rs.overdraw_removed << " overdraw removed (top-left rule), "
+              << rs.blocks_rejected << " blocks rejected, "
+              << rs.blocks_covered << " blocks covered" << std::endl;
+}
+
 //keyboard press event
 void Application::OnKeyPressed(SDL_KeyboardEvent event)
 {
@@ -283,6 +373,61 @@ void Application::OnKeyPressed(SDL_KeyboardEvent event)
         case SDLK_w:
             wireframe = !wireframe;
             break;
+
+        case SDLK_b:
+            useBinning = !useBinning;
+            break;
+
+        case SDLK_i:
+            showStats = !showStats;
+            stats_timer = 1.0f; // print right away
+            break;
+
+        case SDLK_d:
+            useVisibilityBuffer = !useVisibilityBuffer;
+            break;
+
+        case SDLK_o:
+            cullFrustum = !cullFrustum;
+            break;
+
+        case SDLK_g:
+            cullClusters = !cullClusters;
+            break;
+
+        case SDLK_e:
+            useLODs = !useLODs;
+            break;
+
+        case SDLK_k:
+            cullBackFaces = !cullBackFaces;
+            break;
+
+        case SDLK_s:
+            cullSmallTriangles = !cullSmallTriangles;
+            break;
+
+        case SDLK_l:
+            swizzleTextures = !swizzleTextures;
+            for (size_t i = 0; i < textures.size(); ++i)
+                textures[i]->SetSwizzled(swizzleTextures);
+            break;
+
+        case SDLK_m:
+            sampler.filter = (sSamplerState::eFilter)((sampler.filter + 1) % 3);
+            std::cout << "Texture filter: " << (sampler.filter == sSamplerState::NEAREST ? "nearest" : sampler.filter == sSamplerState::BILINEAR ? "bilinear" : "trilinear") << std::endl;
+            break;
+
+        case SDLK_r:
+            sampler.wrap = (sSamplerState::eWrap)((sampler.wrap + 1) % 3);
+            std::cout << "Texture wrap: " << (sampler.wrap == sSamplerState::CLAMP ? "clamp" : sampler.wrap == sSamplerState::REPEAT ? "repeat" : "mirror") << std::endl;
+            break;
+
+        case SDLK_h:
+            useHiZ = !useHiZ;
+            if (zbuffer)
+                zbuffer->EnableHiZ(useHiZ);
+            break;
             
         // increase (move the object further away if selected toggle = V)
         case SDLK_PLUS:
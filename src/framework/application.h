@@ -7,11 +7,13 @@
 #include "main/includes.h"
 #include "framework.h"
 #include "image.h"
+#include "imageregistry.h"
 #include "button.h"
 #include "ParticleSystem.h"
 #include "mesh.h"
 #include "camera.h"
 #include "entity.h"
+#include "rasterizer.h"
 
 class Application
 {
@@ -129,6 +131,45 @@ public:
     bool useZBuffer = true;      // Z
     bool interpolateUV = true;   // C
     bool wireframe = false; // W
+
+    // Tile binning rasterizer (multithreaded), toggled with B
+    Rasterizer rasterizer;
+    bool useBinning = true;
+
+    // Hierarchical z next to the zbuffer (skips occluded blocks/triangles), toggled with H.
+    // Off by default: it only pays off when big triangles are hidden behind already drawn ones.
+    bool useHiZ = false;
+
+    // Visibility buffer inside the tile rasterizer (depth + triangle id first, then shade once), toggled with D
+    bool useVisibilityBuffer = false;
+
+    // Reorder the triangles of the loaded meshes for the vertex cache and for overdraw
+    bool optimizeMeshes = true;
+
+    // Culling stage of the entities
+    bool cullFrustum = true;        // O
+    bool cullClusters = true;       // G (meshlets)
+    bool useLODs = true;            // E (levels of detail)
+    bool cullBackFaces = true;      // K
+    bool cullSmallTriangles = true; // S
+
+    // Textures of the entities, stored in 8x8 Z-order tiles so the fetch cost doesn't depend on the rotation, toggled with L.
+    // They are owned by the registry, the app holds one reference per texture in the list.
+    ImageRegistry images;
+    size_t textureBudget = 64 * 1024 * 1024; // Unused textures are evicted past this
+    std::vector<Image*> textures;
+    bool swizzleTextures = true;
+    // BC1 style blocks (6x less memory), encoded once at load time. Off by default: it is lossy and slower to
+    // sample than the plain texels, and Decompress can't undo the loss, so it is only read when loading.
+    bool compressTextures = false;
+
+    // Texture filter (M cycles nearest / bilinear / trilinear) and wrap mode (R: clamp / repeat / mirror)
+    sSamplerState sampler;
+
+    // Print the render counters once per second, toggled with I
+    bool showStats = false;
+    float stats_timer = 0.0f;
+    void PrintStats();
     
     void ApplyInteractivityToEntity(Entity* e);
 };
@@ -176,6 +176,58 @@ void Camera::UpdateProjectionMatrix()
 void Camera::UpdateViewProjectionMatrix()
 {
 	viewprojection_matrix = projection_matrix * view_matrix;
+	UpdateFrustumPlanes();
+}
+
+// A point is inside the clip volume if -w <= x,y,z <= w, with (x,y,z,w) = M * p. Each of these is
+// dot(row, p) >= 0 with row = row3 +- row0/1/2 of the matrix, so the rows give the planes directly.
+void Camera::UpdateFrustumPlanes()
+{
+	const float* m = viewprojection_matrix.m; // Column major: row r is m[r], m[4 + r], m[8 + r], m[12 + r]
+	for (int i = 0; i < 6; ++i)
+	{
+		int r = i / 2;
+		float s = (i % 2 == 0) ? 1.0f : -1.0f;
+		Vector4& plane = frustum_planes[i];
+		plane.Set(m[3] + s * m[r], m[7] + s * m[4 + r], m[11] + s * m[8 + r], m[15] + s * m[12 + r]);
+
+		// Unit normal so w and the tests below are real distances
+		float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+		if (length > 0.0f)
+			plane.Set(plane.x / length, plane.y / length, plane.z / length, plane.w / length);
+	}
+}
+
+int Camera::TestSphere(const Vector3& center, float radius) const
+{
+	int result = INSIDE;
+	for (int i = 0; i < 6; ++i)
+	{
+		const Vector4& plane = frustum_planes[i];
+		float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+		if (distance < -radius)
+			return OUTSIDE;
+		if (distance < radius)
+			result = INTERSECT;
+	}
+	return result;
+}
+
+int Camera::TestBox(const Vector3& center, const Vector3& halfSize) const
+{
+	int result = INSIDE;
+	for (int i = 0; i < 6; ++i)
+	{
+		// Distance of the center and how far the box reaches along the normal of the plane
+		const Vector4& plane = frustum_planes[i];
+		float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+		float reach = fabsf(plane.x) * halfSize.x + fabsf(plane.y) * halfSize.y + fabsf(plane.z) * halfSize.z;
+		if (distance < -reach)
+			return OUTSIDE;
+		if (distance < reach)
+			result = INTERSECT;
+	}
+	return result;
 }
 
 Matrix44 Camera::GetViewProjectionMatrix()
@@ -44,6 +44,13 @@ public:
 	Matrix44 projection_matrix;
 	Matrix44 viewprojection_matrix;
 
+	// Frustum planes in world space (left, right, bottom, top, near, far), updated with viewprojection_matrix.
+	// xyz is the normal (unit length, pointing inside) and w the distance, a point p is inside if dot(xyz, p) + w >= 0
+	Vector4 frustum_planes[6];
+
+	// Result of the frustum tests
+	enum { OUTSIDE, INTERSECT, INSIDE };
+
 	Camera();
 
 	// Setters
@@ -68,6 +75,12 @@ public:
 	void UpdateViewMatrix();
 	void UpdateProjectionMatrix();
 	void UpdateViewProjectionMatrix();
+	void UpdateFrustumPlanes();
+
+	// Bounding volumes (world space) against the frustum. They are conservative: INTERSECT can be returned
+	// for volumes that are just outside near a corner of the frustum, OUTSIDE is always right.
+	int TestSphere(const Vector3& center, float radius) const;
+	int TestBox(const Vector3& center, const Vector3& halfSize) const;
 
 	Matrix44 GetViewProjectionMatrix();
 };
@@ -7,6 +7,9 @@
 
 #include "entity.h"
 #include "mesh.h"
+#include "rasterizer.h"
+
+#include <algorithm>
 
 // Constructor: initialize pointers and set identity matrix
 Entity::Entity()
@@ -23,61 +26,193 @@ Entity::~Entity()
 {
 }
 
-void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer)
+// Outcodes: one bit per clip plane the vertex (in homogeneous clip space) is outside of.
+// x/y are not clipped against the screen: the rasterizer already clips its bounding box,
+// they only need clipping if they leave the guard band (keeps the fixed point coords small).
+enum { OUT_LEFT = 1, OUT_RIGHT = 2, OUT_BOTTOM = 4, OUT_TOP = 8, OUT_NEAR = 16, OUT_FAR = 32, OUT_GUARD = 64 };
+static const float GUARD_BAND = 16.0f; // In NDC units, 16 screens wide
+
+static inline int Outcode(float x, float y, float z, float w)
+{
+    float g = GUARD_BAND * w;
+    return (x < -w ? OUT_LEFT : 0) | (x > w ? OUT_RIGHT : 0) |
+           (y < -w ? OUT_BOTTOM : 0) | (y > w ? OUT_TOP : 0) |
+           (z < -w ? OUT_NEAR : 0) | (z > w ? OUT_FAR : 0) |
+           (x < -g || x > g || y < -g || y > g ? OUT_GUARD : 0);
+}
+
+// From clip space to screen (divide by w, then convert [-1,1] to [0, W/H]), z stays in NDC
+static inline Vector3 ClipToScreen(float x, float y, float z, float w, float width, float height)
+{
+    return Vector3((x / w * 0.5f + 0.5f) * width, (y / w * 0.5f + 0.5f) * height, z / w);
+}
+
+void sTransformedVertices::Resize(size_t n)
+{
+    x.resize(n); y.resize(n); z.resize(n); w.resize(n);
+    sx.resize(n); sy.resize(n); sz.resize(n);
+    outcode.resize(n);
+}
+
+// Transform stage: all the vertices go through the model-view-projection matrix into clip space,
+// and get their outcode and screen position in the same pass. The SSE loop does 4 vertices at a time
+// with the same operations in the same order as the scalar loop, so both give the same floats.
+static void TransformVertices(const Vector3* vertices, size_t n, const Matrix44& mvp, float width, float height, sTransformedVertices& out)
+{
+    out.Resize(n);
+    const float* m = mvp.m;
+    size_t i = 0;
+
+#ifdef RASTER_SSE
+    static_assert(sizeof(Vector3) == 3 * sizeof(float), "the vertices are read as packed floats");
+    const __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]), m3 = _mm_set1_ps(m[3]);
+    const __m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6 = _mm_set1_ps(m[6]), m7 = _mm_set1_ps(m[7]);
+    const __m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]), m11 = _mm_set1_ps(m[11]);
+    const __m128 m12 = _mm_set1_ps(m[12]), m13 = _mm_set1_ps(m[13]), m14 = _mm_set1_ps(m[14]), m15 = _mm_set1_ps(m[15]);
+    const __m128 half = _mm_set1_ps(0.5f), sign = _mm_set1_ps(-0.0f), guard = _mm_set1_ps(GUARD_BAND);
+    const __m128 screenW = _mm_set1_ps(width), screenH = _mm_set1_ps(height);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        // 4 packed xyz (12 floats) transposed into x, y and z of the 4 vertices
+        const float* p = &vertices[i].x;
+        __m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+        __m128 vx = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 vy = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 vz = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+        __m128 cx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, vx), _mm_mul_ps(m4, vy)), _mm_mul_ps(m8, vz)), m12);
+        __m128 cy = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, vx), _mm_mul_ps(m5, vy)), _mm_mul_ps(m9, vz)), m13);
+        __m128 cz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, vx), _mm_mul_ps(m6, vy)), _mm_mul_ps(m10, vz)), m14);
+        __m128 cw = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, vx), _mm_mul_ps(m7, vy)), _mm_mul_ps(m11, vz)), m15);
+        _mm_storeu_ps(&out.x[i], cx);
+        _mm_storeu_ps(&out.y[i], cy);
+        _mm_storeu_ps(&out.z[i], cz);
+        _mm_storeu_ps(&out.w[i], cw);
+
+        _mm_storeu_ps(&out.sx[i], _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(cx, cw), half), half), screenW));
+        _mm_storeu_ps(&out.sy[i], _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(cy, cw), half), half), screenH));
+        _mm_storeu_ps(&out.sz[i], _mm_div_ps(cz, cw));
+
+        // Outcodes: every compare gives a lane mask, kept as the bit of its plane
+        __m128 nw = _mm_xor_ps(cw, sign);
+        __m128 g = _mm_mul_ps(guard, cw), ng = _mm_xor_ps(g, sign);
+        auto bit = [](__m128 mask, int plane) { return _mm_and_si128(_mm_castps_si128(mask), _mm_set1_epi32(plane)); };
+        __m128i code = _mm_or_si128(_mm_or_si128(bit(_mm_cmplt_ps(cx, nw), OUT_LEFT), bit(_mm_cmpgt_ps(cx, cw), OUT_RIGHT)),
+                                    _mm_or_si128(bit(_mm_cmplt_ps(cy, nw), OUT_BOTTOM), bit(_mm_cmpgt_ps(cy, cw), OUT_TOP)));
+        code = _mm_or_si128(code, _mm_or_si128(bit(_mm_cmplt_ps(cz, nw), OUT_NEAR), bit(_mm_cmpgt_ps(cz, cw), OUT_FAR)));
+        __m128 outGuard = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(cx, ng), _mm_cmpgt_ps(cx, g)), _mm_or_ps(_mm_cmplt_ps(cy, ng), _mm_cmpgt_ps(cy, g)));
+        code = _mm_or_si128(code, bit(outGuard, OUT_GUARD));
+        _mm_storeu_si128((__m128i*)&out.outcode[i], code);
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        const Vector3& v = vertices[i];
+        float cx = m[0] * v.x + m[4] * v.y + m[8] * v.z + m[12];
+        float cy = m[1] * v.x + m[5] * v.y + m[9] * v.z + m[13];
+        float cz = m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14];
+        float cw = m[3] * v.x + m[7] * v.y + m[11] * v.z + m[15];
+        out.x[i] = cx; out.y[i] = cy; out.z[i] = cz; out.w[i] = cw;
+
+        Vector3 screen = ClipToScreen(cx, cy, cz, cw, width, height);
+        out.sx[i] = screen.x; out.sy[i] = screen.y; out.sz[i] = screen.z;
+        out.outcode[i] = Outcode(cx, cy, cz, cw);
+    }
+}
+
+// Biggest scale of the axes of a model matrix, a local sphere of radius r fits in a world sphere of radius r * scale
+static float GetMaxScale(const Matrix44& model)
 {
+    const float* m = model.m;
+    Vector3 axisX(m[0], m[1], m[2]), axisY(m[4], m[5], m[6]), axisZ(m[8], m[9], m[10]);
+    return std::max(axisX.Length(), std::max(axisY.Length(), axisZ.Length()));
+}
+
+bool Entity::IsOutsideFrustum(const Camera& camera) const
+{
+    const float* m = model.m;
+
+    // Sphere first: the center goes through the model matrix and the radius grows with its biggest axis scale
+    int result = camera.TestSphere(model * mesh->GetSphereCenter(), mesh->GetSphereRadius() * GetMaxScale(model));
+    if (result != Camera::INTERSECT)
+        return result == Camera::OUTSIDE;
+
+    // Near the border the box is tighter: world box around the moved local box (each world axis
+    // gets the absolute projection of the 3 local half sizes)
+    Vector3 center = (mesh->GetAABBMin() + mesh->GetAABBMax()) * 0.5f;
+    Vector3 half = (mesh->GetAABBMax() - mesh->GetAABBMin()) * 0.5f;
+    Vector3 worldHalf(fabsf(m[0]) * half.x + fabsf(m[4]) * half.y + fabsf(m[8]) * half.z,
+                      fabsf(m[1]) * half.x + fabsf(m[5]) * half.y + fabsf(m[9]) * half.z,
+                      fabsf(m[2]) * half.x + fabsf(m[6]) * half.y + fabsf(m[10]) * half.z);
+    return camera.TestBox(model * center, worldHalf) == Camera::OUTSIDE;
+}
+
+int Entity::SelectLOD(const Camera& camera, float viewportHeight) const
+{
+    // Pixels per world unit at the nearest point of the bounding sphere, so the sphere is about
+    // 2 * radius * pixelsPerUnit pixels tall on screen
+    float scale = GetMaxScale(model);
+    float pixelsPerUnit;
+    if (camera.type == Camera::PERSPECTIVE)
+    {
+        float distance = (model * mesh->GetSphereCenter() - camera.eye).Length() - mesh->GetSphereRadius() * scale;
+        if (distance <= camera.near_plane) // Too close (or inside), full detail
+            return 0;
+        pixelsPerUnit = viewportHeight / (2.0f * tanf(camera.fov * 0.5f) * distance);
+    }
+    else
+        pixelsPerUnit = viewportHeight / fabsf(camera.top - camera.bottom);
+
+    // Coarser levels have bigger errors, keep the last one that still fits
+    int level = 0;
+    for (int i = 1; i < mesh->GetNumLODs(); ++i)
+    {
+        if (mesh->GetLOD(i)->GetLODError() * scale * pixelsPerUnit <= lodPixelError)
+            level = i;
+    }
+    return level;
+}
+
+void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer, Rasterizer* rasterizer)
+{
+    cullStats.Clear();
+
     if (!mesh || !camera || !framebuffer)
         return;
 
+    // Frustum culling: an entity that is all outside the view skips the transform stage and every triangle
+    cullStats.entities++;
+    if (cullFrustum && IsOutsideFrustum(*camera))
+    {
+        cullStats.outside_frustum++;
+        return;
+    }
+
     // If Z is disabled, we just ignore the zbuffer pointer
     FloatImage* zb = useZBuffer ? zBuffer : NULL;
 
-    // From clip space to Screen (convert [-1,1] to [0, W/H])
-    auto clipToScreen = [framebuffer](const Vector3& p) -> Vector2
-    {
-        float x = (p.x * 0.5f + 0.5f) * (float)framebuffer->width;
-        float y = (p.y * 0.5f + 0.5f) * (float)framebuffer->height;
-        return Vector2(x, y);
-    };
+    const float width = (float)framebuffer->width;
+    const float height = (float)framebuffer->height;
 
-    // check automatically clip bounds x,y in [-1,1]
-    auto isInsideClipCube = [](const Vector3& p) -> bool
-    {
-        return (p.x >= -1.0f && p.x <= 1.0f &&
-                p.y >= -1.0f && p.y <= 1.0f &&
-                p.z >= -1.0f && p.z <= 1.0f);
-    };
+    // Level of detail: everything below draws the level picked for the size of the entity on screen
+    Mesh* lodMesh = useLODs ? mesh->GetLOD(SelectLOD(*camera, height)) : mesh;
+    cullStats.lod_triangles_skipped += mesh->GetNumTriangles() - lodMesh->GetNumTriangles();
 
-    const std::vector<Vector3>& vertices = mesh->GetVertices();
-    const std::vector<Vector2>& uvs = mesh->GetUVs();
+    const std::vector<Vector3>& vertices = lodMesh->GetVertices();
+    const std::vector<Vector2>& uvs = lodMesh->GetUVs();
+    const std::vector<unsigned int>& indices = lodMesh->GetIndices();
 
     // We can still render without UVs if we are not using texture,
     // but if we want texture we need uvs.
     bool meshHasUVs = (uvs.size() == vertices.size());
 
-    for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+    // Everything after clipping: s0..s2 are the screen positions (x, y in pixels, z in NDC) and w0..w2 the clip w
+    auto drawTriangle = [&](const Vector3& s0, const Vector3& s1, const Vector3& s2, float w0, float w1, float w2,
+                            const Vector2& uv0, const Vector2& uv1, const Vector2& uv2,
+                            const Color& c0, const Color& c1, const Color& c2)
     {
-        Vector3 v0 = vertices[i];
-        Vector3 v1 = vertices[i + 1];
-        Vector3 v2 = vertices[i + 2];
-
-        // Local -> World
-        Vector3 w0 = model * v0;
-        Vector3 w1 = model * v1;
-        Vector3 w2 = model * v2;
-
-        // World -> View -> Clip space
-        Vector3 p0 = camera->ProjectVector(w0);
-        Vector3 p1 = camera->ProjectVector(w1);
-        Vector3 p2 = camera->ProjectVector(w2);
-
-        // check clip bounds
-        if (!isInsideClipCube(p0) || !isInsideClipCube(p1) || !isInsideClipCube(p2))
-            continue;
-
-        Vector2 s0 = clipToScreen(p0);
-        Vector2 s1 = clipToScreen(p1);
-        Vector2 s2 = clipToScreen(p2);
-        
         // just use points with SetPixel function
         if (mode == eRenderMode::POINTCLOUD)
         {
@@ -85,7 +220,7 @@ void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer)
             framebuffer->SetPixel((int)s0.x, (int)s0.y, Color::WHITE);
             framebuffer->SetPixel((int)s1.x, (int)s1.y, Color::WHITE);
             framebuffer->SetPixel((int)s2.x, (int)s2.y, Color::WHITE);
-            continue;
+            return;
         }
 
         // Wireframe mode
@@ -95,36 +230,61 @@ void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer)
             framebuffer->DrawLineDDA((int)s0.x, (int)s0.y, (int)s1.x, (int)s1.y, Color::WHITE);
             framebuffer->DrawLineDDA((int)s1.x, (int)s1.y, (int)s2.x, (int)s2.y, Color::WHITE);
             framebuffer->DrawLineDDA((int)s2.x, (int)s2.y, (int)s0.x, (int)s0.y, Color::WHITE);
-            continue;
+            return;
         }
 
-        // Filled modes need (x,y,z)
-        Vector3 sp0(s0.x, s0.y, p0.z);
-        Vector3 sp1(s1.x, s1.y, p1.z);
-        Vector3 sp2(s2.x, s2.y, p2.z);
+        // Culling stage: drop what the rasterizer would not draw anyway, before any setup.
+        // Same 28.4 snapping as DrawTriangleInterpolated so we never drop a triangle it would draw.
+        cullStats.triangles++;
+        if (cullBackFaces || cullSmallTriangles)
+        {
+            long long X0 = (long long)floor(s0.x * 16.0f + 0.5f), Y0 = (long long)floor(s0.y * 16.0f + 0.5f);
+            long long X1 = (long long)floor(s1.x * 16.0f + 0.5f), Y1 = (long long)floor(s1.y * 16.0f + 0.5f);
+            long long X2 = (long long)floor(s2.x * 16.0f + 0.5f), Y2 = (long long)floor(s2.y * 16.0f + 0.5f);
 
-        // Build triangle info
+            // Signed area on screen: front faces are counter-clockwise (y goes up in the framebuffer)
+            long long area = (X1 - X0) * (Y2 - Y0) - (Y1 - Y0) * (X2 - X0);
+            if (cullBackFaces && area < 0)
+            {
+                cullStats.backfaces++;
+                return;
+            }
+
+            if (cullSmallTriangles)
+            {
+                // Pixel x has its center at x*16 + 8: check if some center falls inside the bounding box
+                long long minXf = std::min(X0, std::min(X1, X2)), maxXf = std::max(X0, std::max(X1, X2));
+                long long minYf = std::min(Y0, std::min(Y1, Y2)), maxYf = std::max(Y0, std::max(Y1, Y2));
+                bool noCenter = ((minXf + 7) >> 4) > ((maxXf - 8) >> 4) || ((minYf + 7) >> 4) > ((maxYf - 8) >> 4);
+                if (area == 0 || noCenter)
+                {
+                    cullStats.small_triangles++;
+                    return;
+                }
+            }
+        }
+
+        // Build triangle info, filled modes need (x,y,z)
         sTriangleInfo tri;
-        tri.p0 = sp0; tri.p1 = sp1; tri.p2 = sp2;
+        tri.p0 = s0;
+        tri.p1 = s1;
+        tri.p2 = s2;
 
-        // Default UVs
-        tri.uv0 = Vector2(0,0);
-        tri.uv1 = Vector2(0,0);
-        tri.uv2 = Vector2(0,0);
+        // w is kept for perspective correct interpolation of the attributes
+        tri.w0 = w0;
+        tri.w1 = w1;
+        tri.w2 = w2;
 
-        if (meshHasUVs)
-        {
-            tri.uv0 = uvs[i];
-            tri.uv1 = uvs[i + 1];
-            tri.uv2 = uvs[i + 2];
-        }
+        tri.uv0 = uv0;
+        tri.uv1 = uv1;
+        tri.uv2 = uv2;
 
-        // Set debug vertex colors
-        tri.c0 = Color::RED;
-        tri.c1 = Color::GREEN;
-        tri.c2 = Color::BLUE;
+        tri.c0 = c0;
+        tri.c1 = c1;
+        tri.c2 = c2;
 
         tri.texture = texture;
+        tri.sampler = sampler;
 
         // Triangles: plain color
         // Triangles Interpolated: texture (UV interp) OR vertex color per vertex (barycentric)
@@ -145,7 +305,208 @@ void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer)
             tri.useTexture = canUseTexture ? true : false;
         }
 
-        framebuffer->DrawTriangleInterpolated(tri, zb);
+        // Binned path: the rasterizer draws it later in parallel (zbuffer is the one given to Rasterizer::Begin)
+        if (rasterizer)
+            rasterizer->AddTriangle(tri);
+        else
+            framebuffer->DrawTriangleInterpolated(tri, zb);
+    };
+
+    // Everything after the transform stage for one triangle. i0..i2 are its vertices in the transformed
+    // arrays and v0..v2 in the mesh (they are the same unless the meshlet path gathered the vertices).
+    const sTransformedVertices& tv = transformed;
+    auto drawTransformed = [&](unsigned int i0, unsigned int i1, unsigned int i2, unsigned int v0, unsigned int v1, unsigned int v2)
+    {
+        int oc0 = tv.outcode[i0], oc1 = tv.outcode[i1], oc2 = tv.outcode[i2];
+
+        // All the vertices outside the same plane: nothing to see. Not for the guard band, its bit is
+        // set for any of the 4 sides (and for every w < 0), so a triangle around the screen has it on all 3.
+        if ((oc0 & oc1 & oc2) & ~OUT_GUARD)
+            return;
+
+        Vector2 uv0(0,0), uv1(0,0), uv2(0,0); // Default UVs
+        if (meshHasUVs)
+        {
+            uv0 = uvs[v0];
+            uv1 = uvs[v1];
+            uv2 = uvs[v2];
+        }
+
+        // Fast path (almost every triangle): between the near and far planes and inside the guard band
+        if (((oc0 | oc1 | oc2) & (OUT_NEAR | OUT_FAR | OUT_GUARD)) == 0)
+        {
+            // debug vertex colors
+            drawTriangle(Vector3(tv.sx[i0], tv.sy[i0], tv.sz[i0]), Vector3(tv.sx[i1], tv.sy[i1], tv.sz[i1]), Vector3(tv.sx[i2], tv.sy[i2], tv.sz[i2]),
+                         tv.w[i0], tv.w[i1], tv.w[i2], uv0, uv1, uv2, Color::RED, Color::GREEN, Color::BLUE);
+            return;
+        }
+
+        // Clip against the near plane (and the far plane and guard band if needed) in clip space, where
+        // attributes are still linear. Every vertex keeps its weights of the original corners.
+        struct sClipVertex { Vector4 h; Vector3 w; };
+        sClipVertex poly[16], tmp[16];
+        poly[0].h = Vector4(tv.x[i0], tv.y[i0], tv.z[i0], tv.w[i0]); poly[0].w = Vector3(1, 0, 0);
+        poly[1].h = Vector4(tv.x[i1], tv.y[i1], tv.z[i1], tv.w[i1]); poly[1].w = Vector3(0, 1, 0);
+        poly[2].h = Vector4(tv.x[i2], tv.y[i2], tv.z[i2], tv.w[i2]); poly[2].w = Vector3(0, 0, 1);
+        int count = 3;
+
+        // Signed distance to each plane, positive inside
+        auto clipPlane = [&](float (*dist)(const Vector4&, float))
+        {
+            int n = 0;
+            for (int k = 0; k < count; ++k)
+            {
+                const sClipVertex& a = poly[k];
+                const sClipVertex& b = poly[(k + 1) % count];
+                float da = dist(a.h, GUARD_BAND);
+                float db = dist(b.h, GUARD_BAND);
+
+                if (da >= 0)
+                    tmp[n++] = a;
+                if ((da >= 0) != (db >= 0))
+                {
+                    float t = da / (da - db);
+                    tmp[n].h = Vector4(a.h.x + (b.h.x - a.h.x) * t, a.h.y + (b.h.y - a.h.y) * t,
+                                       a.h.z + (b.h.z - a.h.z) * t, a.h.w + (b.h.w - a.h.w) * t);
+                    tmp[n].w = a.w + (b.w - a.w) * t;
+                    n++;
+                }
+            }
+            for (int k = 0; k < n; ++k)
+                poly[k] = tmp[k];
+            count = n;
+        };
+
+        clipPlane([](const Vector4& c, float) { return c.z + c.w; }); // near: z >= -w
+        if ((oc0 | oc1 | oc2) & OUT_FAR)
+            clipPlane([](const Vector4& c, float) { return c.w - c.z; }); // far: z <= w (the zbuffer starts at 1e9, it wouldn't stop them)
+        if ((oc0 | oc1 | oc2) & OUT_GUARD)
+        {
+            clipPlane([](const Vector4& c, float g) { return g * c.w + c.x; });
+            clipPlane([](const Vector4& c, float g) { return g * c.w - c.x; });
+            clipPlane([](const Vector4& c, float g) { return g * c.w + c.y; });
+            clipPlane([](const Vector4& c, float g) { return g * c.w - c.y; });
+        }
+
+        // Triangle fan of the clipped polygon
+        for (int k = 1; k + 1 < count; ++k)
+        {
+            const sClipVertex* v[3] = { &poly[0], &poly[k], &poly[k + 1] };
+            Vector3 sp[3];
+            Vector2 uv[3];
+            Color c[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                const Vector4& h = v[j]->h;
+                sp[j] = ClipToScreen(h.x, h.y, h.z, h.w, width, height);
+                const Vector3& w = v[j]->w;
+                uv[j] = uv0 * w.x + uv1 * w.y + uv2 * w.z;
+                c[j] = Color::RED * w.x + Color::GREEN * w.y + Color::BLUE * w.z;
+            }
+            drawTriangle(sp[0], sp[1], sp[2], v[0]->h.w, v[1]->h.w, v[2]->h.w, uv[0], uv[1], uv[2], c[0], c[1], c[2]);
+        }
+    };
+
+    Matrix44 mvp = camera->viewprojection_matrix * model;
+    const std::vector<sMeshlet>& meshlets = lodMesh->GetMeshlets();
+
+    // Meshlet path: whole clusters are culled first (outside the frustum, or all back faces seen from the eye),
+    // then only the vertices of the ones left are transformed, and their triangles drawn meshlet by meshlet.
+    if (cullClusters && !meshlets.empty())
+    {
+        const std::vector<unsigned int>& meshletVertices = lodMesh->GetMeshletVertices();
+        const std::vector<unsigned char>& meshletTriangles = lodMesh->GetMeshletTriangles();
+
+        // The cone test needs the eye in the space of the mesh. It is done for perspective cameras only, and not
+        // for mirroring model matrices (their back faces are the front faces on screen).
+        bool coneTest = cullBackFaces && camera->type == Camera::PERSPECTIVE &&
+                        (mode == eRenderMode::TRIANGLES || mode == eRenderMode::TRIANGLES_INTERPOLATED);
+        Vector3 localEye;
+        if (coneTest)
+        {
+            const float* m = model.m;
+            Matrix44 inverse = model;
+            float det = Vector3(m[0], m[1], m[2]).Cross(Vector3(m[4], m[5], m[6])).Dot(Vector3(m[8], m[9], m[10]));
+            coneTest = det > 0.0f && inverse.Inverse();
+            localEye = inverse * camera->eye;
+        }
+        float scale = GetMaxScale(model);
+
+        visibleMeshlets.clear();
+        meshletPositions.clear();
+        // Unused slots are -1 between draws, only the ones written here are reset at the end (not the whole mesh)
+        if (meshletSlots.size() < vertices.size())
+            meshletSlots.resize(vertices.size(), (unsigned int)-1);
+        for (size_t i = 0; i < meshlets.size(); ++i)
+        {
+            const sMeshlet& meshlet = meshlets[i];
+            cullStats.clusters++;
+            if (camera->TestSphere(model * meshlet.center, meshlet.radius * scale) == Camera::OUTSIDE)
+            {
+                cullStats.clusters_outside_frustum++;
+                continue;
+            }
+            if (coneTest)
+            {
+                Vector3 toApex = meshlet.cone_apex - localEye;
+                float distance = toApex.Length();
+                if (toApex.Dot(meshlet.cone_axis) >= meshlet.cone_cutoff * distance)
+                {
+                    cullStats.clusters_back_facing++;
+                    continue;
+                }
+            }
+            visibleMeshlets.push_back((unsigned int)i);
+
+            // Vertices shared with a meshlet already in the batch keep their slot, so each one is transformed once
+            for (unsigned int k = 0; k < meshlet.num_vertices; ++k)
+            {
+                unsigned int v = meshletVertices[meshlet.first_vertex + k];
+                if (meshletSlots[v] == (unsigned int)-1)
+                {
+                    meshletSlots[v] = (unsigned int)meshletPositions.size();
+                    meshletPositions.push_back(vertices[v]);
+                }
+            }
+        }
+
+        // One batch with the vertices of all the visible meshlets
+        TransformVertices(meshletPositions.data(), meshletPositions.size(), mvp, width, height, transformed);
+        cullStats.vertices += meshletPositions.size();
+
+        for (size_t i = 0; i < visibleMeshlets.size(); ++i)
+        {
+            const sMeshlet& meshlet = meshlets[visibleMeshlets[i]];
+            const unsigned int* meshVertex = &meshletVertices[meshlet.first_vertex];
+            const unsigned char* triangle = &meshletTriangles[meshlet.first_triangle * 3];
+            for (unsigned int t = 0; t < meshlet.num_triangles; ++t, triangle += 3)
+            {
+                unsigned int v0 = meshVertex[triangle[0]], v1 = meshVertex[triangle[1]], v2 = meshVertex[triangle[2]];
+                drawTransformed(meshletSlots[v0], meshletSlots[v1], meshletSlots[v2], v0, v1, v2);
+            }
+        }
+
+        for (size_t i = 0; i < visibleMeshlets.size(); ++i)
+        {
+            const sMeshlet& meshlet = meshlets[visibleMeshlets[i]];
+            for (unsigned int k = 0; k < meshlet.num_vertices; ++k)
+                meshletSlots[meshletVertices[meshlet.first_vertex + k]] = (unsigned int)-1;
+        }
+        return;
+    }
+
+    // Transform every vertex once (Local -> World -> View -> Clip in one matrix), the triangles that share it reuse the result
+    TransformVertices(vertices.data(), vertices.size(), mvp, width, height, transformed);
+    cullStats.vertices += vertices.size();
+
+    // Not indexed meshes use every 3 vertices as a triangle
+    size_t numCorners = indices.empty() ? vertices.size() : indices.size();
+    for (size_t i = 0; i + 2 < numCorners; i += 3)
+    {
+        unsigned int i0 = indices.empty() ? (unsigned int)i : indices[i];
+        unsigned int i1 = indices.empty() ? (unsigned int)i + 1 : indices[i + 1];
+        unsigned int i2 = indices.empty() ? (unsigned int)i + 2 : indices[i + 2];
+        drawTransformed(i0, i1, i2, i0, i1, i2);
     }
 }
 
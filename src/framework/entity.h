@@ -12,6 +12,42 @@
 #include "image.h"
 #include "camera.h"
 
+class Rasterizer;
+
+// Counters of the culling stage of Entity::Render
+struct sCullStats
+{
+    unsigned long long entities = 0;        // Entities rendered
+    unsigned long long outside_frustum = 0; // Entities skipped whole because their bounds are outside the camera frustum
+    unsigned long long lod_triangles_skipped = 0;    // Triangles of the full meshes not drawn because a coarser level of detail was picked
+    unsigned long long clusters = 0;                 // Meshlets tested (meshlet path only)
+    unsigned long long clusters_outside_frustum = 0; // Meshlets skipped because their sphere is outside the frustum
+    unsigned long long clusters_back_facing = 0;     // Meshlets skipped because all their triangles face away (normal cone)
+    unsigned long long vertices = 0;        // Vertices transformed (once per unique vertex of the mesh or of the visible meshlets)
+    unsigned long long triangles = 0;       // Filled triangles that reached the culling stage
+    unsigned long long backfaces = 0;       // Dropped because they face away from the camera
+    unsigned long long small_triangles = 0; // Dropped because they don't cover any pixel center
+
+    void Clear() { *this = sCullStats(); }
+    void Add(const sCullStats& o)
+    {
+        entities += o.entities; outside_frustum += o.outside_frustum; lod_triangles_skipped += o.lod_triangles_skipped;
+        clusters += o.clusters; clusters_outside_frustum += o.clusters_outside_frustum; clusters_back_facing += o.clusters_back_facing;
+        vertices += o.vertices; triangles += o.triangles; backfaces += o.backfaces; small_triangles += o.small_triangles;
+    }
+};
+
+// Output of the transform stage: every mesh vertex in clip space plus its screen position, in
+// structure of arrays layout so the stage can do 4 vertices at once with SSE
+struct sTransformedVertices
+{
+    std::vector<float> x, y, z, w; // Clip space (before the divide by w), the clipper works with these
+    std::vector<float> sx, sy, sz; // Screen position in pixels and NDC depth (only valid in front of the near plane)
+    std::vector<int> outcode;      // Clip planes the vertex is outside of (see Entity::Render)
+
+    void Resize(size_t n);
+};
+
 // Entity: a renderable object that has a mesh + a model matrix (T/R/S)
 class Entity
 {
@@ -19,6 +55,7 @@ public:
     Mesh* mesh;      // Geometry to render (loaded from OBJ, etc.)
     Matrix44 model;  // Model matrix (scale/rotate/translate)
     Image* texture = NULL;
+    sSamplerState sampler; // How the texture is filtered/wrapped
     
     // Variables to make each entity different (simple scene)
     Vector3 base_position;
@@ -34,9 +71,41 @@ public:
     bool useZBuffer = true;     // Z
     bool interpolateUV = true;  // C
 
+    // Whole entity against the camera frustum, before the transform stage
+    bool cullFrustum = true;        // O
+
+    // Draw the coarsest level of detail of the mesh whose error is at most lodPixelError pixels on screen
+    bool useLODs = true;            // E
+    float lodPixelError = 1.0f;
+
+    // Meshlets of the mesh against the frustum and (with cullBackFaces) their normal cone, before the transform stage
+    bool cullClusters = true;       // G
+
+    // Culling stage, applied to the filled modes before building the sTriangleInfo
+    bool cullBackFaces = true;      // K
+    bool cullSmallTriangles = true; // S
+    sCullStats cullStats;           // Counters of the last Render
+
+    // Every mesh vertex transformed once at the start of Render and read by all the triangles
+    // that share it (kept between frames to reuse the memory)
+    sTransformedVertices transformed;
+
+    // Meshlet path: meshlets that passed the culling, the positions of their vertices in the order they are
+    // transformed and the slot of each mesh vertex in that batch (kept between frames too, -1 when not in it)
+    std::vector<unsigned int> visibleMeshlets;
+    std::vector<Vector3> meshletPositions;
+    std::vector<unsigned int> meshletSlots;
+
     Entity();
     ~Entity();
     
-    void Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer);
+    // If a rasterizer is given, filled triangles are binned into it and drawn on its Flush
+    void Render(Image* framebuffer, Camera* camera, FloatImage* zBuffer, Rasterizer* rasterizer = NULL);
     void Update(float seconds_elapsed);
+
+    // Bounds of the mesh moved by the model matrix, tested against the frustum planes of the camera
+    bool IsOutsideFrustum(const Camera& camera) const;
+
+    // Level of detail of the mesh for its projected size with this camera (0 = the full mesh)
+    int SelectLOD(const Camera& camera, float viewportHeight) const;
 };
@@ -2,12 +2,16 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
 #include "GL/glew.h"
 #include "../extra/picopng.h"
 #include "image.h"
 #include "utils.h"
 #include "camera.h"
 #include "mesh.h"
+#include "sampler.h"
 
 Image::Image() {
 	width = 0; height = 0;
@@ -22,6 +26,12 @@ Image::Image(unsigned int width, unsigned int height)
 	memset(pixels, 0, width * height * sizeof(Color));
 }
 
+// Bytes of the blocks of a compressed image (4x4 pixels in 8 bytes, partial blocks at the borders)
+static size_t BlocksSize(unsigned int width, unsigned int height)
+{
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
 // Copy constructor
 Image::Image(const Image& c)
 {
@@ -29,10 +39,16 @@ Image::Image(const Image& c)
 	width = c.width;
 	height = c.height;
 	bytes_per_pixel = c.bytes_per_pixel;
+	swizzled = c.swizzled;
 	if(c.pixels)
 	{
-		pixels = new Color[width*height];
-		memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
+		pixels = new Color[c.GetStorageSize()];
+		memcpy(pixels, c.pixels, c.GetStorageSize()*sizeof(Color));
+	}
+	if(c.blocks)
+	{
+		blocks = new unsigned char[BlocksSize(width, height)];
+		memcpy(blocks, c.blocks, BlocksSize(width, height));
 	}
 }
 
@@ -41,15 +57,24 @@ Image& Image::operator = (const Image& c)
 {
 	if(pixels) delete[] pixels;
 	pixels = NULL;
+	if(blocks) delete[] blocks;
+	blocks = NULL;
+	ClearMipmaps();
 
 	width = c.width;
 	height = c.height;
 	bytes_per_pixel = c.bytes_per_pixel;
+	swizzled = c.swizzled;
 
 	if(c.pixels)
 	{
-		pixels = new Color[width*height*bytes_per_pixel];
-		memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
+		pixels = new Color[c.GetStorageSize()];
+		memcpy(pixels, c.pixels, c.GetStorageSize()*sizeof(Color));
+	}
+	if(c.blocks)
+	{
+		blocks = new unsigned char[BlocksSize(width, height)];
+		memcpy(blocks, c.blocks, BlocksSize(width, height));
 	}
 	return *this;
 }
@@ -58,10 +83,23 @@ Image::~Image()
 {
 	if(pixels) 
 		delete[] pixels;
+	if(blocks)
+		delete[] blocks;
+	ClearMipmaps();
 }
 
 void Image::Render()
 {
+	// OpenGL wants rows of pixels
+	if (swizzled || blocks)
+	{
+		Image linear = *this;
+		linear.Decompress();
+		linear.SetSwizzled(false);
+		linear.Render();
+		return;
+	}
+
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glDrawPixels(width, height, bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 }
@@ -78,9 +116,13 @@ void Image::Resize(unsigned int width, unsigned int height)
 			new_pixels[ y * width + x ] = GetPixel(x,y);
 
 	delete[] pixels;
+	delete[] blocks;
 	this->width = width;
 	this->height = height;
 	pixels = new_pixels;
+	blocks = NULL;
+	swizzled = false;
+	ClearMipmaps();
 }
 
 // Change image size and scale the content
@@ -93,9 +135,216 @@ void Image::Scale(unsigned int width, unsigned int height)
 			new_pixels[ y * width + x ] = GetPixel((unsigned int)(this->width * (x / (float)width)), (unsigned int)(this->height * (y / (float)height)) );
 
 	delete[] pixels;
+	delete[] blocks;
 	this->width = width;
 	this->height = height;
 	pixels = new_pixels;
+	blocks = NULL;
+	swizzled = false;
+	ClearMipmaps();
+}
+
+void Image::BuildMipmaps()
+{
+	ClearMipmaps();
+
+	// Each level averages 2x2 pixels of the previous one (odd sizes repeat the last row/column)
+	const Image* prev = this;
+	while (prev->width > 1 || prev->height > 1)
+	{
+		unsigned int w = std::max(prev->width / 2, 1u);
+		unsigned int h = std::max(prev->height / 2, 1u);
+		Image* level = new Image(w, h);
+
+		for (unsigned int y = 0; y < h; ++y)
+		{
+			unsigned int y0 = std::min(y * 2, prev->height - 1), y1 = std::min(y * 2 + 1, prev->height - 1);
+			for (unsigned int x = 0; x < w; ++x)
+			{
+				unsigned int x0 = std::min(x * 2, prev->width - 1), x1 = std::min(x * 2 + 1, prev->width - 1);
+				Color a = prev->GetPixel(x0, y0), b = prev->GetPixel(x1, y0);
+				Color c = prev->GetPixel(x0, y1), d = prev->GetPixel(x1, y1);
+				level->SetPixelUnsafe(x, y, Color((float)((a.r + b.r + c.r + d.r + 2) / 4),
+				                                  (float)((a.g + b.g + c.g + d.g + 2) / 4),
+				                                  (float)((a.b + b.b + c.b + d.b + 2) / 4)));
+			}
+		}
+
+		mipmaps.push_back(level);
+		prev = level;
+	}
+
+	// Levels are built row-major, keep them in the same layout (and format) as the base image
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+	{
+		if (swizzled)
+			mipmaps[i]->SetSwizzled(true);
+		if (blocks)
+			mipmaps[i]->Compress();
+	}
+}
+
+void Image::SetSwizzled(bool enable)
+{
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+		mipmaps[i]->SetSwizzled(enable);
+
+	if (enable == swizzled || !pixels)
+	{
+		swizzled = enable;
+		return;
+	}
+
+	// Copy every pixel to its place in the other layout (padding of the tiles stays black)
+	Image converted;
+	converted.width = width;
+	converted.height = height;
+	converted.bytes_per_pixel = bytes_per_pixel;
+	converted.swizzled = enable;
+	converted.pixels = new Color[converted.GetStorageSize()]; // Color() is black
+
+	for (unsigned int y = 0; y < height; ++y)
+		for (unsigned int x = 0; x < width; ++x)
+			converted.SetPixelUnsafe(x, y, GetPixel(x, y));
+
+	std::swap(pixels, converted.pixels);
+	swizzled = enable;
+}
+
+// Encodes 16 pixels (row by row) into a block: the end colors are the extremes of the pixels along
+// their main axis (the direction where the colors change the most), then each pixel takes the closest of the 4 colors
+static void EncodeBlock(const Color px[16], unsigned char* block)
+{
+	// Mean and covariance of the colors
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		mean[0] += px[i].r; mean[1] += px[i].g; mean[2] += px[i].b;
+	}
+	for (int k = 0; k < 3; ++k)
+		mean[k] /= 16.0f;
+
+	float cov[6] = { 0, 0, 0, 0, 0, 0 }; // rr rg rb gg gb bb
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = px[i].r - mean[0], g = px[i].g - mean[1], b = px[i].b - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+
+	// Main axis with a few power iterations (starting from the gray diagonal)
+	float axis[3] = { 1, 1, 1 };
+	for (int it = 0; it < 4; ++it)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+		if (len < 1e-6f)
+			break; // flat block, any axis works
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	// Pixels at both ends of the axis
+	int minI = 0, maxI = 0;
+	float minD = FLT_MAX, maxD = -FLT_MAX;
+	for (int i = 0; i < 16; ++i)
+	{
+		float d = px[i].r * axis[0] + px[i].g * axis[1] + px[i].b * axis[2];
+		if (d < minD) { minD = d; minI = i; }
+		if (d > maxD) { maxD = d; maxI = i; }
+	}
+
+	auto to565 = [](const Color& c) {
+		return (unsigned int)(((c.r * 31 + 127) / 255) << 11 | ((c.g * 63 + 127) / 255) << 5 | ((c.b * 31 + 127) / 255));
+	};
+	unsigned int c0 = to565(px[maxI]), c1 = to565(px[minI]);
+	if (c0 < c1)
+		std::swap(c0, c1); // c0 > c1 selects the 4 color mode
+
+	block[0] = c0 & 255; block[1] = c0 >> 8;
+	block[2] = c1 & 255; block[3] = c1 >> 8;
+	block[4] = block[5] = block[6] = block[7] = 0;
+	if (c0 == c1)
+		return; // a single color, every index is 0
+
+	// Closest color of the decoded palette for each pixel
+	Color colors[4];
+	Image::DecodeBlockColors(block, colors);
+	for (int i = 0; i < 16; ++i)
+	{
+		int best = 0, bestDist = INT_MAX;
+		for (int k = 0; k < 4; ++k)
+		{
+			int dr = px[i].r - colors[k].r, dg = px[i].g - colors[k].g, db = px[i].b - colors[k].b;
+			int dist = dr * dr + dg * dg + db * db;
+			if (dist < bestDist) { bestDist = dist; best = k; }
+		}
+		block[4 + i / 4] |= best << ((i % 4) * 2);
+	}
+}
+
+void Image::Compress()
+{
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+		mipmaps[i]->Compress();
+
+	if (blocks || !pixels)
+		return;
+
+	// GetPixel reads the blocks once they are set, so they are assigned at the end
+	unsigned char* encoded = new unsigned char[BlocksSize(width, height)];
+	unsigned char* block = encoded;
+	for (unsigned int by = 0; by < height; by += 4)
+		for (unsigned int bx = 0; bx < width; bx += 4, block += 8)
+		{
+			// Blocks over the border repeat the last row/column
+			Color px[16];
+			for (unsigned int y = 0; y < 4; ++y)
+				for (unsigned int x = 0; x < 4; ++x)
+					px[y * 4 + x] = GetPixel(std::min(bx + x, width - 1), std::min(by + y, height - 1));
+			EncodeBlock(px, block);
+		}
+
+	blocks = encoded;
+	delete[] pixels;
+	pixels = NULL;
+}
+
+void Image::Decompress()
+{
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+		mipmaps[i]->Decompress();
+
+	if (!blocks)
+		return;
+
+	pixels = new Color[GetStorageSize()]; // Tile padding stays black (Color())
+	for (unsigned int y = 0; y < height; ++y)
+		for (unsigned int x = 0; x < width; ++x)
+			SetPixelUnsafe(x, y, GetBlockPixel(x, y));
+
+	delete[] blocks;
+	blocks = NULL;
+}
+
+size_t Image::GetMemorySize() const
+{
+	size_t size = 0;
+	if (pixels)
+		size += GetStorageSize() * sizeof(Color);
+	if (blocks)
+		size += BlocksSize(width, height);
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+		size += mipmaps[i]->GetMemorySize();
+	return size;
+}
+
+void Image::ClearMipmaps()
+{
+	for (size_t i = 0; i < mipmaps.size(); ++i)
+		delete mipmaps[i];
+	mipmaps.clear();
 }
 
 Image Image::GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height)
@@ -112,6 +361,18 @@ Image Image::GetArea(unsigned int start_x, unsigned int start_y, unsigned int wi
 
 void Image::FlipY()
 {
+	if (blocks)
+		Decompress();
+
+	if (swizzled)
+	{
+		// Rows are not contiguous, swap pixel by pixel
+		for (unsigned int y = 0; y < height / 2; ++y)
+			for (unsigned int x = 0; x < width; ++x)
+				std::swap(GetPixelRef(x, y), GetPixelRef(x, height - y - 1));
+		return;
+	}
+
 	int row_size = bytes_per_pixel * width;
 	Uint8* temp_row = new Uint8[row_size];
 #pragma omp simd
@@ -164,6 +425,10 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
 	
 	// Force 3 channels
 	bytes_per_pixel = 3;
+	swizzled = false;
+	if (blocks) delete[] blocks;
+	blocks = NULL;
+	ClearMipmaps();
 
 	if (originalBytesPerPixel == 3) {
 		if (pixels) delete[] pixels;
@@ -254,6 +519,11 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
 	// Save info in image
 	if(pixels)
 		delete[] pixels;
+	if(blocks)
+		delete[] blocks;
+	blocks = NULL;
+	swizzled = false;
+	ClearMipmaps();
 
 	width = tgainfo->width;
 	height = tgainfo->height;
@@ -309,7 +579,7 @@ bool Image::SaveTGA(const char* filename)
 	for(unsigned int y = 0; y < height; ++y)
 		for(unsigned int x = 0; x < width; ++x)
 		{
-			Color c = pixels[y*width+x];
+			Color c = GetPixel(x, y);
 			unsigned int pos = (y*width+x)*3;
 			bytes[pos+2] = c.r;
 			bytes[pos+1] = c.g;
@@ -340,6 +610,7 @@ void ForEachPixel(Image& img, const Image& img2, F f) {
 
 FloatImage::FloatImage(unsigned int width, unsigned int height)
 {
+	hiz = NULL;
 	this->width = width;
 	this->height = height;
 	pixels = new float[width * height];
@@ -349,6 +620,7 @@ FloatImage::FloatImage(unsigned int width, unsigned int height)
 // Copy constructor
 FloatImage::FloatImage(const FloatImage& c) {
 	pixels = NULL;
+	hiz = NULL; // Copies don't carry the hierarchical z, enable it again if needed
 
 	width = c.width;
 	height = c.height;
@@ -372,6 +644,10 @@ FloatImage& FloatImage::operator = (const FloatImage& c)
 		pixels = new float[width * height * sizeof(float)];
 		memcpy(pixels, c.pixels, width * height * sizeof(float));
 	}
+
+	// Keep our hierarchical z (if any) but rebuild it for the new content
+	if (hiz)
+		hiz->Resize(width, height);
 	return *this;
 }
 
@@ -379,6 +655,17 @@ FloatImage::~FloatImage()
 {
 	if (pixels)
 		delete[] pixels;
+	delete hiz;
+}
+
+void FloatImage::Fill(const float& v)
+{
+	for (unsigned int pos = 0; pos < width * height; ++pos)
+		pixels[pos] = v;
+
+	// Every block now has exactly this depth
+	if (hiz)
+		hiz->Reset(v);
 }
 
 // Change image size (the old one will remain in the top-left corner)
@@ -396,6 +683,152 @@ void FloatImage::Resize(unsigned int width, unsigned int height)
 	this->width = width;
 	this->height = height;
 	pixels = new_pixels;
+
+	// The blocks and tiles follow the new size, all dirty since the content changed
+	if (hiz)
+		hiz->Resize(width, height);
+}
+
+void FloatImage::EnableHiZ(bool enable)
+{
+	if (!enable)
+	{
+		delete hiz;
+		hiz = NULL;
+		return;
+	}
+
+	if (!hiz)
+	{
+		hiz = new HiZBuffer();
+		hiz->Resize(width, height); // Starts all dirty, the current content is unknown
+	}
+}
+
+// Every block and tile starts dirty
+void HiZBuffer::Resize(unsigned int width, unsigned int height)
+{
+	blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	block_max.assign(blocks_x * blocks_y, 0.0f);
+	block_dirty.assign(blocks_x * blocks_y, 1);
+	tile_max.assign(tiles_x * tiles_y, 0.0f);
+	tile_dirty.assign(tiles_x * tiles_y, 1);
+}
+
+void HiZBuffer::Reset(float v)
+{
+	std::fill(block_max.begin(), block_max.end(), v);
+	std::fill(block_dirty.begin(), block_dirty.end(), 0);
+	std::fill(tile_max.begin(), tile_max.end(), v);
+	std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+}
+
+void HiZBuffer::MarkDirty(int minX, int minY, int maxX, int maxY)
+{
+	for (int by = minY / BLOCK_SIZE; by <= maxY / BLOCK_SIZE; ++by)
+		for (int bx = minX / BLOCK_SIZE; bx <= maxX / BLOCK_SIZE; ++bx)
+			block_dirty[by * blocks_x + bx] = 1;
+
+	for (int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ++ty)
+		for (int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; ++tx)
+			tile_dirty[ty * tiles_x + tx] = 1;
+}
+
+float HiZBuffer::GetBlockMax(const FloatImage& zbuffer, int bx, int by)
+{
+	int index = by * blocks_x + bx;
+	if (block_dirty[index])
+		UpdateBlock(zbuffer, bx, by);
+	return block_max[index];
+}
+
+void HiZBuffer::UpdateBlock(const FloatImage& zbuffer, int bx, int by)
+{
+	int x0 = bx * BLOCK_SIZE;
+	int y0 = by * BLOCK_SIZE;
+	int x1 = std::min(x0 + BLOCK_SIZE, (int)zbuffer.width);
+	int y1 = std::min(y0 + BLOCK_SIZE, (int)zbuffer.height);
+
+	float m = -FLT_MAX;
+#ifdef RASTER_SSE
+	// Full width block: two vectors per row
+	if (x1 - x0 == BLOCK_SIZE)
+	{
+		__m128 m4 = _mm_set1_ps(-FLT_MAX);
+		for (int y = y0; y < y1; ++y)
+		{
+			const float* row = zbuffer.pixels + y * zbuffer.width + x0;
+			m4 = _mm_max_ps(m4, _mm_max_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4)));
+		}
+		m4 = _mm_max_ps(m4, _mm_shuffle_ps(m4, m4, _MM_SHUFFLE(1, 0, 3, 2)));
+		m4 = _mm_max_ps(m4, _mm_shuffle_ps(m4, m4, _MM_SHUFFLE(2, 3, 0, 1)));
+		m = _mm_cvtss_f32(m4);
+	}
+	else
+#endif
+	{
+		for (int y = y0; y < y1; ++y)
+		{
+			const float* row = zbuffer.pixels + y * zbuffer.width;
+			for (int x = x0; x < x1; ++x)
+				m = std::max(m, row[x]);
+		}
+	}
+
+	int index = by * blocks_x + bx;
+	block_max[index] = m;
+	block_dirty[index] = 0;
+	tile_dirty[(by * BLOCK_SIZE / TILE_SIZE) * tiles_x + (bx * BLOCK_SIZE / TILE_SIZE)] = 1;
+}
+
+float HiZBuffer::GetTileMax(const FloatImage& zbuffer, int tx, int ty)
+{
+	int index = ty * tiles_x + tx;
+	if (!tile_dirty[index])
+		return tile_max[index];
+
+	// Recompute from the blocks of the tile
+	const int blocks_per_tile = TILE_SIZE / BLOCK_SIZE;
+	int bx0 = tx * blocks_per_tile;
+	int by0 = ty * blocks_per_tile;
+	int bx1 = std::min(bx0 + blocks_per_tile, (int)blocks_x);
+	int by1 = std::min(by0 + blocks_per_tile, (int)blocks_y);
+
+	float m = -FLT_MAX;
+	for (int by = by0; by < by1; ++by)
+		for (int bx = bx0; bx < bx1; ++bx)
+			m = std::max(m, GetBlockMax(zbuffer, bx, by));
+
+	tile_max[index] = m;
+	tile_dirty[index] = 0;
+	return m;
+}
+
+bool HiZBuffer::IsOccluded(const FloatImage& zbuffer, int minX, int minY, int maxX, int maxY, float minZ)
+{
+	int bx0 = minX / BLOCK_SIZE, bx1 = maxX / BLOCK_SIZE;
+	int by0 = minY / BLOCK_SIZE, by1 = maxY / BLOCK_SIZE;
+
+	// Small boxes (most triangles) check their few blocks directly
+	if ((bx1 - bx0 + 1) * (by1 - by0 + 1) <= 16)
+	{
+		for (int by = by0; by <= by1; ++by)
+			for (int bx = bx0; bx <= bx1; ++bx)
+				if (GetBlockMax(zbuffer, bx, by) > minZ)
+					return false;
+		return true;
+	}
+
+	// Big ones go through the tiles first
+	for (int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ++ty)
+		for (int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; ++tx)
+			if (GetTileMax(zbuffer, tx, ty) > minZ)
+				return false;
+	return true;
 }
 
 // Function for drawing lines implemented
@@ -600,90 +1033,655 @@ float EdgeFunction(const Vector3& a, const Vector3& b, const Vector3& c)
     return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
 }
 
-void Image::DrawTriangleInterpolated(const sTriangleInfo& t, FloatImage* zbuffer)
+// Plane equation of an attribute over the screen: value = (c + dy * fy) + dx * fx
+struct sPlane
+{
+    float dx, dy, c;
+    float Row(float fy) const { return c + dy * fy; }
+};
+
+// Everything DrawTriangleInterpolated computes once per triangle
+struct sRasterSetup
+{
+    // Edge functions in fixed point: E = A*x + B*y + C with x,y in 1/16 of pixel (28.4).
+    // They are positive inside the triangle whatever its orientation.
+    long long A0, B0, C0;
+    long long A1, B1, C1;
+    long long A2, B2, C2;
+
+    // Top-left rule: a pixel is inside if E > thr for the three edges.
+    // thr is -1 (E >= 0) for top and left edges and 0 (E > 0) for the others,
+    // so a pixel exactly on an edge shared by two triangles is only drawn by one of them.
+    int thr0, thr1, thr2;
+
+    // Barycentrics are E / (E0 + E1 + E2)
+    float invArea;
+
+    // All the edge values inside the box fit in 32 bits (needed by the SSE path)
+    bool fitsInt32;
+
+    // Attribute planes (see SetupPlanes). fx = x + biasX and fy = y + biasY is the
+    // center of pixel (x, y) relative to vertex 0
+    float biasX, biasY;
+    sPlane q;       // 1/w
+    sPlane u, v;    // uv/w (texture)
+    sPlane r, g, b; // color/w (no texture)
+
+    // Texture filtering. With mipmaps the footprint of the pixel comes from the uv derivatives (level 0 size)
+    Sampler sampler;
+    bool doMip;
+    float texW, texH;
+
+    bool doZ;
+    bool doTexture;
+    sRasterStats* stats;
+};
+
+// Snap a screen coordinate to fixed point (28.4: 1/16 of pixel)
+static inline long long ToFixed(float v)
+{
+    return (long long)floor(v * 16.0f + 0.5f);
+}
+
+// Edge functions, top-left thresholds and 1/area of the triangle.
+// Returns false if the snapped triangle has no area.
+static bool SetupEdges(const sTriangleInfo& t, sRasterSetup& s)
+{
+    long long X0 = ToFixed(t.p0.x), Y0 = ToFixed(t.p0.y);
+    long long X1 = ToFixed(t.p1.x), Y1 = ToFixed(t.p1.y);
+    long long X2 = ToFixed(t.p2.x), Y2 = ToFixed(t.p2.y);
+
+    // Signed area: cross product (exact in integers)
+    long long area = (X1 - X0) * (Y2 - Y0) - (Y1 - Y0) * (X2 - X0);
+    if (area == 0)
+        return false;
+
+    // Each edge function E = A*px + B*py + C is linear in the pixel position, so moving
+    // one pixel right adds A*16 and moving one row up adds B*16.
+    s.A0 = Y1 - Y2; s.B0 = X2 - X1; s.C0 = X1 * Y2 - Y1 * X2;
+    s.A1 = Y2 - Y0; s.B1 = X0 - X2; s.C1 = X2 * Y0 - Y2 * X0;
+    s.A2 = Y0 - Y1; s.B2 = X1 - X0; s.C2 = X0 * Y1 - Y0 * X1;
+
+    // Flip the edges of clockwise triangles so inside is always positive
+    if (area < 0)
+    {
+        s.A0 = -s.A0; s.B0 = -s.B0; s.C0 = -s.C0;
+        s.A1 = -s.A1; s.B1 = -s.B1; s.C1 = -s.C1;
+        s.A2 = -s.A2; s.B2 = -s.B2; s.C2 = -s.C2;
+        area = -area;
+    }
+
+    // Left edges: the inside is to their right (A > 0). Top edges: horizontal with the inside below (y goes up in the framebuffer)
+    auto isTopLeft = [](long long A, long long B) { return A > 0 || (A == 0 && B < 0); };
+    s.thr0 = isTopLeft(s.A0, s.B0) ? -1 : 0;
+    s.thr1 = isTopLeft(s.A1, s.B1) ? -1 : 0;
+    s.thr2 = isTopLeft(s.A2, s.B2) ? -1 : 0;
+
+    s.invArea = 1.0f / (float)area;
+    return true;
+}
+
+// Attributes are interpolated with plane equations set up once per triangle.
+// With perspective, attribute/w and 1/w are linear on screen (attribute alone is not),
+// so we interpolate those and divide back per pixel.
+static void SetupPlanes(const sTriangleInfo& t, sRasterSetup& s)
+{
+    // Same snapped positions as the edges (in pixels)
+    double x0 = ToFixed(t.p0.x) / 16.0, y0 = ToFixed(t.p0.y) / 16.0;
+    double x1 = ToFixed(t.p1.x) / 16.0, y1 = ToFixed(t.p1.y) / 16.0;
+    double x2 = ToFixed(t.p2.x) / 16.0, y2 = ToFixed(t.p2.y) / 16.0;
+
+    double dx1 = x1 - x0, dy1 = y1 - y0;
+    double dx2 = x2 - x0, dy2 = y2 - y0;
+    double invArea = 1.0 / (dx1 * dy2 - dx2 * dy1); // SetupEdges already rejected zero area
+
+    // Pixel centers are measured from vertex 0, which keeps the numbers small
+    s.biasX = (float)(0.5 - x0);
+    s.biasY = (float)(0.5 - y0);
+
+    // Gradient of the values a0, a1, a2 at the vertices (Cramer's rule)
+    auto plane = [&](double a0, double a1, double a2) -> sPlane
+    {
+        sPlane p;
+        p.dx = (float)(((a1 - a0) * dy2 - (a2 - a0) * dy1) * invArea);
+        p.dy = (float)(((a2 - a0) * dx1 - (a1 - a0) * dx2) * invArea);
+        p.c = (float)a0;
+        return p;
+    };
+
+    double q0 = 1.0 / t.w0, q1 = 1.0 / t.w1, q2 = 1.0 / t.w2;
+    s.q = plane(q0, q1, q2);
+
+    if (s.doTexture)
+    {
+        s.u = plane(t.uv0.x * q0, t.uv1.x * q1, t.uv2.x * q2);
+        s.v = plane(t.uv0.y * q0, t.uv1.y * q1, t.uv2.y * q2);
+
+        s.sampler.Setup(t.texture, t.sampler);
+        s.doMip = s.sampler.HasMipmaps();
+        s.texW = (float)t.texture->width;
+        s.texH = (float)t.texture->height;
+    }
+    else
+    {
+        s.doMip = false;
+        s.r = plane(t.c0.r * q0, t.c1.r * q1, t.c2.r * q2);
+        s.g = plane(t.c0.g * q0, t.c1.g * q1, t.c2.g * q2);
+        s.b = plane(t.c0.b * q0, t.c1.b * q1, t.c2.b * q2);
+    }
+}
+
+// Perspective correct uv at the pixel center (fx, fy)
+static inline Vector2 PlaneUV(const sRasterSetup& s, float fx, float fy)
+{
+    float invQ = 1.0f / (s.q.Row(fy) + s.q.dx * fx);
+    return Vector2((s.u.Row(fy) + s.u.dx * fx) * invQ, (s.v.Row(fy) + s.v.dx * fx) * invQ);
+}
+
+// Squared footprint (in level 0 texels) of the 2x2 quad that contains pixel (x, y). Like GPUs, the uv
+// derivatives are the differences between the pixels of the quad, so the 4 pixels share the mip level.
+static inline float QuadRho2(const sRasterSetup& s, int x, int y)
+{
+    float fx = (float)(x & ~1) + s.biasX;
+    float fy = (float)(y & ~1) + s.biasY;
+
+    Vector2 uv00 = PlaneUV(s, fx, fy);
+    Vector2 uv10 = PlaneUV(s, fx + 1.0f, fy);
+    Vector2 uv01 = PlaneUV(s, fx, fy + 1.0f);
+
+    float dudx = (uv10.x - uv00.x) * s.texW, dvdx = (uv10.y - uv00.y) * s.texH;
+    float dudy = (uv01.x - uv00.x) * s.texW, dvdy = (uv01.y - uv00.y) * s.texH;
+    return std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+}
+
+// Color of pixel (x, y) (scalar shading, the SSE path does the same math 4 at a time)
+static inline Color ShadeFragment(const sRasterSetup& s, int x, int y)
+{
+    float fx = (float)x + s.biasX;
+    float fy = (float)y + s.biasY;
+
+    // Choose shading mode:
+    // If useTexture and texture exists -> sample texture using interpolated UV
+    // Else -> interpolate colors (or plain color if all c0=c1=c2)
+    if (s.doTexture)
+    {
+        // The sampler clamps or wraps the uvs
+        Vector2 uv = PlaneUV(s, fx, fy);
+        float rho2 = s.doMip ? QuadRho2(s, x, y) : 0.0f;
+        return s.sampler.Sample(uv.x, uv.y, rho2);
+    }
+
+    float invQ = 1.0f / (s.q.Row(fy) + s.q.dx * fx); // = w at the pixel
+
+    // if no texture, interpolate the vertex colors (clamped, rounding can go a bit over 255)
+    float r = (s.r.Row(fy) + s.r.dx * fx) * invQ;
+    float g = (s.g.Row(fy) + s.g.dx * fx) * invQ;
+    float b = (s.b.Row(fy) + s.b.dx * fx) * invQ;
+    r = std::min(std::max(r, 0.0f), 255.0f);
+    g = std::min(std::max(g, 0.0f), 255.0f);
+    b = std::min(std::max(b, 0.0f), 255.0f);
+    return Color(r, g, b);
+}
+
+// Rasterizes the pixels [x, x1] of row y. e0/e1/e2 are the edge functions at the center of pixel x.
+// With VISIBILITY the visible pixels only get the triangle id in idRow (no shading).
+// With COVERED the caller knows every pixel is inside the triangle, so coverage is not tested.
+// Returns true if some depth was written.
+template <bool VISIBILITY, bool COVERED>
+static inline bool RasterSpan(const sTriangleInfo& t, const sRasterSetup& s, Color* colorRow, float* depthRow,
+                              unsigned int* idRow, unsigned int id,
+                              int x, int x1, int y, long long e0, long long e1, long long e2)
+{
+    bool wroteDepth = false;
+
+    // Edge deltas for one pixel to the right
+    const long long stepX0 = s.A0 * 16;
+    const long long stepX1 = s.A1 * 16;
+    const long long stepX2 = s.A2 * 16;
+
+#ifdef RASTER_SSE
+    // 4-wide path: test and shade 4 consecutive pixels of the row at once.
+    // It uses the exact same integer edges and float math as the scalar loop, so both give the same pixels.
+    if (s.fitsInt32 && x + 3 <= x1)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 invArea = _mm_set1_ps(s.invArea);
+        const __m128i minusOne = _mm_set1_epi32(-1);
+        const __m128i thr0 = _mm_set1_epi32(s.thr0);
+        const __m128i thr1 = _mm_set1_epi32(s.thr1);
+        const __m128i thr2 = _mm_set1_epi32(s.thr2);
+
+        // Planes at the start of this row: value = row + dx * fx. The visibility pass has no planes
+        // (SetupPlanes is not called for it), so they stay at zero instead of reading the unset setup.
+        const bool shade = !VISIBILITY;
+        const bool texture = shade && s.doTexture;
+        const float fy = shade ? (float)y + s.biasY : 0.0f;
+        const __m128 biasX = _mm_set1_ps(shade ? s.biasX : 0.0f);
+        const __m128 rowQ = _mm_set1_ps(shade ? s.q.Row(fy) : 0.0f), dxQ = _mm_set1_ps(shade ? s.q.dx : 0.0f);
+        const __m128 rowA = _mm_set1_ps(!shade ? 0.0f : texture ? s.u.Row(fy) : s.r.Row(fy)), dxA = _mm_set1_ps(!shade ? 0.0f : texture ? s.u.dx : s.r.dx);
+        const __m128 rowB = _mm_set1_ps(!shade ? 0.0f : texture ? s.v.Row(fy) : s.g.Row(fy)), dxB = _mm_set1_ps(!shade ? 0.0f : texture ? s.v.dx : s.g.dx);
+        const __m128 rowC = _mm_set1_ps(!shade || texture ? 0.0f : s.b.Row(fy)), dxC = _mm_set1_ps(!shade || texture ? 0.0f : s.b.dx);
+
+        // Mip selection: the planes at the two rows of the 2x2 quads of this row
+        const bool mip = texture && s.doMip;
+        const float quadY = mip ? (float)(y & ~1) + s.biasY : 0.0f;
+        const __m128 quadQ0 = _mm_set1_ps(mip ? s.q.Row(quadY) : 0.0f), quadQ1 = _mm_set1_ps(mip ? s.q.Row(quadY + 1.0f) : 0.0f);
+        const __m128 quadU0 = _mm_set1_ps(mip ? s.u.Row(quadY) : 0.0f), quadU1 = _mm_set1_ps(mip ? s.u.Row(quadY + 1.0f) : 0.0f);
+        const __m128 quadV0 = _mm_set1_ps(mip ? s.v.Row(quadY) : 0.0f), quadV1 = _mm_set1_ps(mip ? s.v.Row(quadY + 1.0f) : 0.0f);
+        const __m128 texW = _mm_set1_ps(mip ? s.texW : 0.0f), texH = _mm_set1_ps(mip ? s.texH : 0.0f);
+
+        __m128i e0_4 = _mm_add_epi32(_mm_set1_epi32((int)e0), _mm_set_epi32((int)(3 * stepX0), (int)(2 * stepX0), (int)stepX0, 0));
+        __m128i e1_4 = _mm_add_epi32(_mm_set1_epi32((int)e1), _mm_set_epi32((int)(3 * stepX1), (int)(2 * stepX1), (int)stepX1, 0));
+        __m128i e2_4 = _mm_add_epi32(_mm_set1_epi32((int)e2), _mm_set_epi32((int)(3 * stepX2), (int)(2 * stepX2), (int)stepX2, 0));
+        __m128i x_4 = _mm_add_epi32(_mm_set1_epi32(x), _mm_set_epi32(3, 2, 1, 0));
+
+        const __m128i step0 = _mm_set1_epi32((int)(4 * stepX0));
+        const __m128i step1 = _mm_set1_epi32((int)(4 * stepX1));
+        const __m128i step2 = _mm_set1_epi32((int)(4 * stepX2));
+        const __m128i four = _mm_set1_epi32(4);
+
+        int start = x;
+        for (; x + 3 <= x1; x += 4)
+        {
+            // Coverage mask of the 4 pixels
+            __m128 inside = COVERED ? _mm_castsi128_ps(minusOne)
+                                    : _mm_castsi128_ps(_mm_and_si128(_mm_cmpgt_epi32(e0_4, thr0), _mm_and_si128(_mm_cmpgt_epi32(e1_4, thr1), _mm_cmpgt_epi32(e2_4, thr2))));
+
+            // Pixels a plain ">= 0" test would also have drawn (the ones on shared edges)
+            if (!COVERED && s.stats)
+            {
+                __m128i old = _mm_and_si128(_mm_cmpgt_epi32(e0_4, minusOne), _mm_and_si128(_mm_cmpgt_epi32(e1_4, minusOne), _mm_cmpgt_epi32(e2_4, minusOne)));
+                int removed = _mm_movemask_ps(_mm_castsi128_ps(old)) & ~_mm_movemask_ps(inside);
+                for (; removed; removed &= removed - 1)
+                    s.stats->overdraw_removed++;
+            }
+
+            if (_mm_movemask_ps(inside))
+            {
+                // Depth test, only the covered lanes that pass write their depth (z/w is linear on screen, barycentrics are fine)
+                if (s.doZ)
+                {
+                    __m128 alpha4 = _mm_mul_ps(_mm_cvtepi32_ps(e0_4), invArea);
+                    __m128 beta4  = _mm_mul_ps(_mm_cvtepi32_ps(e1_4), invArea);
+                    __m128 gamma4 = _mm_mul_ps(_mm_cvtepi32_ps(e2_4), invArea);
+                    __m128 z4 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha4, _mm_set1_ps(t.p0.z)), _mm_mul_ps(beta4, _mm_set1_ps(t.p1.z))), _mm_mul_ps(gamma4, _mm_set1_ps(t.p2.z)));
+                    __m128 current = _mm_loadu_ps(depthRow + x);
+                    inside = _mm_and_ps(inside, _mm_cmplt_ps(z4, current));
+                    _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(inside, z4), _mm_andnot_ps(inside, current)));
+                }
+
+                int mask = _mm_movemask_ps(inside);
+                if (mask)
+                {
+                    wroteDepth = true;
+                    if (s.stats)
+                        for (int m = mask; m; m &= m - 1)
+                        {
+                            s.stats->fragments++;
+                            if (!VISIBILITY)
+                                s.stats->shaded++;
+                        }
+
+                    if (VISIBILITY)
+                    {
+                        // Shading is deferred, just remember who owns the pixel
+                        for (int i = 0; i < 4; ++i)
+                            if (mask & (1 << i))
+                                idRow[x + i] = id;
+                    }
+                    else
+                    {
+                        // Plane evaluation and perspective divide of the 4 pixels
+                        __m128 fx = _mm_add_ps(_mm_cvtepi32_ps(x_4), biasX);
+                        __m128 invQ = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(rowQ, _mm_mul_ps(dxQ, fx)));
+                        __m128 a = _mm_mul_ps(_mm_add_ps(rowA, _mm_mul_ps(dxA, fx)), invQ);
+                        __m128 b = _mm_mul_ps(_mm_add_ps(rowB, _mm_mul_ps(dxB, fx)), invQ);
+
+                        if (s.doTexture)
+                        {
+                            // a, b are the UVs, the sampler filters the covered lanes
+                            __m128 rho2 = zero;
+                            if (s.doMip)
+                            {
+                                // uv at the pixels (0,0), (1,0) and (0,1) of the quad of each lane (same math as QuadRho2)
+                                __m128 qx = _mm_add_ps(_mm_cvtepi32_ps(_mm_and_si128(x_4, _mm_set1_epi32(~1))), biasX);
+                                __m128 qx1 = _mm_add_ps(qx, _mm_set1_ps(1.0f));
+
+                                __m128 invQ00 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(quadQ0, _mm_mul_ps(dxQ, qx)));
+                                __m128 invQ10 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(quadQ0, _mm_mul_ps(dxQ, qx1)));
+                                __m128 invQ01 = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(quadQ1, _mm_mul_ps(dxQ, qx)));
+                                __m128 u00 = _mm_mul_ps(_mm_add_ps(quadU0, _mm_mul_ps(dxA, qx)), invQ00);
+                                __m128 v00 = _mm_mul_ps(_mm_add_ps(quadV0, _mm_mul_ps(dxB, qx)), invQ00);
+                                __m128 u10 = _mm_mul_ps(_mm_add_ps(quadU0, _mm_mul_ps(dxA, qx1)), invQ10);
+                                __m128 v10 = _mm_mul_ps(_mm_add_ps(quadV0, _mm_mul_ps(dxB, qx1)), invQ10);
+                                __m128 u01 = _mm_mul_ps(_mm_add_ps(quadU1, _mm_mul_ps(dxA, qx)), invQ01);
+                                __m128 v01 = _mm_mul_ps(_mm_add_ps(quadV1, _mm_mul_ps(dxB, qx)), invQ01);
+
+                                __m128 dudx = _mm_mul_ps(_mm_sub_ps(u10, u00), texW), dvdx = _mm_mul_ps(_mm_sub_ps(v10, v00), texH);
+                                __m128 dudy = _mm_mul_ps(_mm_sub_ps(u01, u00), texW), dvdy = _mm_mul_ps(_mm_sub_ps(v01, v00), texH);
+                                rho2 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(dudx, dudx), _mm_mul_ps(dvdx, dvdx)),
+                                                  _mm_add_ps(_mm_mul_ps(dudy, dudy), _mm_mul_ps(dvdy, dvdy)));
+                            }
+
+                            s.sampler.Sample4(a, b, rho2, mask, colorRow + x);
+                        }
+                        else
+                        {
+                            // a, b, c are r, g, b
+                            __m128 c = _mm_mul_ps(_mm_add_ps(rowC, _mm_mul_ps(dxC, fx)), invQ);
+                            const __m128 maxColor = _mm_set1_ps(255.0f);
+
+                            int cr[4], cg[4], cb[4];
+                            _mm_storeu_si128((__m128i*)cr, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(a, zero), maxColor)));
+                            _mm_storeu_si128((__m128i*)cg, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(b, zero), maxColor)));
+                            _mm_storeu_si128((__m128i*)cb, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(c, zero), maxColor)));
+
+                            for (int i = 0; i < 4; ++i)
+                            {
+                                if (mask & (1 << i))
+                                {
+                                    Color& col = colorRow[x + i];
+                                    col.r = (unsigned char)cr[i];
+                                    col.g = (unsigned char)cg[i];
+                                    col.b = (unsigned char)cb[i];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            e0_4 = _mm_add_epi32(e0_4, step0);
+            e1_4 = _mm_add_epi32(e1_4, step1);
+            e2_4 = _mm_add_epi32(e2_4, step2);
+            x_4 = _mm_add_epi32(x_4, four);
+        }
+
+        // Move the scalar edges to the first pixel left
+        long long dx = x - start;
+        e0 += stepX0 * dx;
+        e1 += stepX1 * dx;
+        e2 += stepX2 * dx;
+    }
+#endif
+
+    // Scalar loop: the whole span without SSE (or for huge triangles), otherwise only the last (< 4) pixels
+    for (; x <= x1; ++x, e0 += stepX0, e1 += stepX1, e2 += stepX2)
+    {
+        // check if the point is inside the triangle (with the top-left rule)
+        if (!COVERED && (e0 <= s.thr0 || e1 <= s.thr1 || e2 <= s.thr2))
+        {
+            if (s.stats && e0 >= 0 && e1 >= 0 && e2 >= 0)
+                s.stats->overdraw_removed++;
+            continue;
+        }
+
+        // Depth test (in case we use zbuffer)
+        if (s.doZ)
+        {
+            // Barycentrics: proportion of area of the each sub-triangle from the total area
+            float alpha = (float)e0 * s.invArea;
+            float beta  = (float)e1 * s.invArea;
+            float gamma = (float)e2 * s.invArea;
+
+            float z = alpha * t.p0.z + beta * t.p1.z + gamma * t.p2.z;
+            if (z >= depthRow[x])
+                continue;
+            depthRow[x] = z;
+            wroteDepth = true;
+        }
+
+        if (s.stats)
+        {
+            s.stats->fragments++;
+            if (!VISIBILITY)
+                s.stats->shaded++;
+        }
+
+        if (VISIBILITY)
+            idRow[x] = id;
+        else
+            colorRow[x] = ShadeFragment(s, x, y);
+    }
+
+    return wroteDepth;
+}
+
+// Shared by DrawTriangleInterpolated (shades the pixels) and DrawTriangleVisibility (only writes depth and id)
+template <bool VISIBILITY>
+static void RasterTriangle(Image& image, const sTriangleInfo& t, FloatImage* zbuffer, unsigned int* ids, unsigned int id,
+                           int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats)
 {
-    // 1) Bounding box
+    // 1) Snap the vertices to fixed point (28.4: 1/16 of pixel)
+    // From here on coverage is computed with integers, so it doesn't depend on where
+    // the triangle is on screen, on the tile it is drawn from, or on SSE vs scalar.
+    long long X0 = ToFixed(t.p0.x), Y0 = ToFixed(t.p0.y);
+    long long X1 = ToFixed(t.p1.x), Y1 = ToFixed(t.p1.y);
+    long long X2 = ToFixed(t.p2.x), Y2 = ToFixed(t.p2.y);
+
+    // 2) Bounding box
     // instead of looping through all the screen, we find the minimum rectangle
-    // containing the triangle
-    int minX = (int)floor(std::min(t.p0.x, std::min(t.p1.x, t.p2.x)));
-    int maxX = (int)ceil (std::max(t.p0.x, std::max(t.p1.x, t.p2.x)));
-    int minY = (int)floor(std::min(t.p0.y, std::min(t.p1.y, t.p2.y)));
-    int maxY = (int)ceil (std::max(t.p0.y, std::max(t.p1.y, t.p2.y)));
-
-    if (minX < 0) minX = 0;
-    if (minY < 0) minY = 0;
-    if (maxX >= (int)width)  maxX = (int)width - 1;
-    if (maxY >= (int)height) maxY = (int)height - 1;
-
-    // 2) Signed area: cross product
-    float area = (t.p1.x - t.p0.x) * (t.p2.y - t.p0.y) - (t.p1.y - t.p0.y) * (t.p2.x - t.p0.x);
-    if (fabs(area) < 1e-6f)
+    // containing the triangle. Pixel x has its center at x*16 + 8, so we keep
+    // the pixels whose center falls inside [min, max].
+    long long minXf = std::min(X0, std::min(X1, X2)), maxXf = std::max(X0, std::max(X1, X2));
+    long long minYf = std::min(Y0, std::min(Y1, Y2)), maxYf = std::max(Y0, std::max(Y1, Y2));
+
+    int minX = (int)((minXf + 7) >> 4);
+    int maxX = (int)((maxXf - 8) >> 4);
+    int minY = (int)((minYf + 7) >> 4);
+    int maxY = (int)((maxYf - 8) >> 4);
+
+    // Clip the box to the allowed region (whole image or a single tile)
+    if (minX < clipMinX) minX = clipMinX;
+    if (minY < clipMinY) minY = clipMinY;
+    if (maxX > clipMaxX) maxX = clipMaxX;
+    if (maxY > clipMaxY) maxY = clipMaxY;
+
+    if (minX > maxX || minY > maxY)
         return;
 
-    bool doZ = (zbuffer != NULL);
+    // 3) Triangle setup (done once)
+    sRasterSetup s;
+    if (!SetupEdges(t, s))
+        return;
 
-    // 3) Raster
-    // loop through all pixels in box
-    for (int y = minY; y <= maxY; ++y)
+    // Edge values are linear, so their largest magnitude inside the box is at one of its corners
+    long long cx0 = minX * 16 + 8, cx1 = maxX * 16 + 8;
+    long long cy0 = minY * 16 + 8, cy1 = maxY * 16 + 8;
+    auto maxAbs = [&](long long A, long long B, long long C) {
+        long long m = 0;
+        m = std::max(m, std::abs(A * cx0 + B * cy0 + C));
+        m = std::max(m, std::abs(A * cx1 + B * cy0 + C));
+        m = std::max(m, std::abs(A * cx0 + B * cy1 + C));
+        m = std::max(m, std::abs(A * cx1 + B * cy1 + C));
+        return m;
+    };
+    const long long limit = 0x7fffffffLL - 64 * std::max(std::abs(s.A0), std::max(std::abs(s.A1), std::abs(s.A2)));
+    s.fitsInt32 = maxAbs(s.A0, s.B0, s.C0) < limit && maxAbs(s.A1, s.B1, s.C1) < limit && maxAbs(s.A2, s.B2, s.C2) < limit;
+
+    s.doZ = (zbuffer != NULL);
+    s.doTexture = (t.useTexture && t.texture != NULL);
+    s.stats = stats;
+
+    // The visibility pass does not shade, its second pass sets the planes up
+    if (!VISIBILITY)
+        SetupPlanes(t, s);
+
+    if (stats)
+        stats->triangles++;
+
+    // 4) Raster
+    // Only adds the deltas per pixel and per row inside a rectangle of the box
+    auto rasterRect = [&](int x0, int y0, int x1, int y1, bool covered) -> bool
     {
-        for (int x = minX; x <= maxX; ++x)
+        long long px = x0 * 16 + 8;
+        long long py = y0 * 16 + 8;
+        long long rowE0 = s.A0 * px + s.B0 * py + s.C0;
+        long long rowE1 = s.A1 * px + s.B1 * py + s.C1;
+        long long rowE2 = s.A2 * px + s.B2 * py + s.C2;
+
+        bool wrote = false;
+        for (int y = y0; y <= y1; ++y)
         {
-            float px = x + 0.5f;
-            float py = y + 0.5f;
+            Color* colorRow = image.pixels + y * image.width;
+            float* depthRow = s.doZ ? zbuffer->pixels + y * zbuffer->width : NULL;
+            unsigned int* idRow = VISIBILITY ? ids + y * image.width : NULL;
+
+            bool wroteRow = covered ? RasterSpan<VISIBILITY, true>(t, s, colorRow, depthRow, idRow, id, x0, x1, y, rowE0, rowE1, rowE2)
+                                    : RasterSpan<VISIBILITY, false>(t, s, colorRow, depthRow, idRow, id, x0, x1, y, rowE0, rowE1, rowE2);
+            if (wroteRow)
+                wrote = true;
+
+            rowE0 += s.B0 * 16;
+            rowE1 += s.B1 * 16;
+            rowE2 += s.B2 * 16;
+        }
+        return wrote;
+    };
+
+    // Small triangles (box up to one block) are walked directly: the per pixel
+    // tests are already as cheap as classifying blocks or asking the hierarchical z.
+    HiZBuffer* hiz = s.doZ ? zbuffer->hiz : NULL;
+    const int B = HiZBuffer::BLOCK_SIZE;
+    if ((maxX - minX + 1) * (maxY - minY + 1) <= B * B)
+    {
+        bool wroteDepth = rasterRect(minX, minY, maxX, maxY, false);
+        if (hiz && wroteDepth)
+            hiz->MarkDirty(minX, minY, maxX, maxY);
+        return;
+    }
 
-            // compute the weights
-            float w0 = ((t.p1.x - px) * (t.p2.y - py) - (t.p1.y - py) * (t.p2.x - px));
-            float w1 = ((t.p2.x - px) * (t.p0.y - py) - (t.p2.y - py) * (t.p0.x - px));
-            float w2 = ((t.p0.x - px) * (t.p1.y - py) - (t.p0.y - py) * (t.p1.x - px));
+    // If everything already drawn under the box is closer than the closest vertex, no pixel
+    // can pass the depth test. The small bias keeps interpolation rounding from rejecting ties.
+    float minZ = std::min(t.p0.z, std::min(t.p1.z, t.p2.z)) - 1e-6f;
+    if (hiz && hiz->IsOccluded(*zbuffer, minX, minY, maxX, maxY, minZ))
+        return;
 
-            // check if the point is inside the triangle!
-            
-            bool inside = false;
-            if (area > 0.0f)
-                inside = (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f);
-            else
-                inside = (w0 <= 0.0f && w1 <= 0.0f && w2 <= 0.0f);
+    // Edge test of whole blocks: the edges are linear, so their smallest and biggest value
+    // inside a block are at two of its corners, which depend only on the signs of A and B.
+    // These are the offsets of those corners from the first pixel of the block.
+    const long long span = (B - 1) * 16;
+    const long long min0 = std::min(s.A0, 0LL) * span + std::min(s.B0, 0LL) * span, max0 = std::max(s.A0, 0LL) * span + std::max(s.B0, 0LL) * span;
+    const long long min1 = std::min(s.A1, 0LL) * span + std::min(s.B1, 0LL) * span, max1 = std::max(s.A1, 0LL) * span + std::max(s.B1, 0LL) * span;
+    const long long min2 = std::min(s.A2, 0LL) * span + std::min(s.B2, 0LL) * span, max2 = std::max(s.A2, 0LL) * span + std::max(s.B2, 0LL) * span;
+
+    // Otherwise walk the box in 8x8 blocks (the blocks of the hierarchy): blocks outside
+    // the triangle or hidden are skipped, blocks fully inside skip the coverage tests.
+    // The whole 8x8 block is classified even if the box cuts it, which is still right for the part inside the box.
+    const int firstBx = minX / B, lastBx = maxX / B;
+    for (int by = minY / B; by <= maxY / B; ++by)
+    {
+        int y0 = std::max(by * B, minY);
+        int y1 = std::min(by * B + B - 1, maxY);
 
-            if (!inside)
-                continue;
+        // Edges at the first pixel of the first block of the row
+        long long px = firstBx * B * 16 + 8, py = by * B * 16 + 8;
+        long long rowE0 = s.A0 * px + s.B0 * py + s.C0;
+        long long rowE1 = s.A1 * px + s.B1 * py + s.C1;
+        long long rowE2 = s.A2 * px + s.B2 * py + s.C2;
 
-            // Compute alpha/beta/gamma (proportion of area of the each triangle
-            // from the total area of the big triangle
-            float alpha = w0 / area;
-            float beta  = w1 / area;
-            float gamma = w2 / area;
+        // Returns -1 (skip), 0 (partially covered) or 1 (fully covered)
+        auto classifyBlock = [&](int bx) -> int
+        {
+            long long k = (long long)(bx - firstBx) * B * 16;
+            long long e0 = rowE0 + s.A0 * k, e1 = rowE1 + s.A1 * k, e2 = rowE2 + s.A2 * k;
 
-            // Depth test (in case we use zbuffer)
-            if (doZ)
+            // Rejected only if some edge is negative in the whole block: a block that just touches an edge goes
+            // through the spans, where the pixels the top-left rule skips are counted as overdraw_removed
+            if (e0 + max0 < 0 || e1 + max1 < 0 || e2 + max2 < 0)
             {
-                float z = alpha * t.p0.z + beta * t.p1.z + gamma * t.p2.z;
-                float currentZ = zbuffer->GetPixel(x, y);
-                if (z >= currentZ)
-                    continue;
-                zbuffer->SetPixel(x, y, z);
+                if (stats)
+                    stats->blocks_rejected++;
+                return -1;
             }
 
-            // Choose shading mode:
-            // If useTexture and texture exists -> sample texture using interpolated UV
-            // Else -> interpolate colors (or plain color if all c0=c1=c2)
-            if (t.useTexture && t.texture != NULL)
-            {
-                Vector2 uv = t.uv0 * alpha + t.uv1 * beta + t.uv2 * gamma;
+            if (hiz && hiz->GetBlockMax(*zbuffer, bx, by) <= minZ)
+                return -1;
 
-                if (uv.x < 0) uv.x = 0; if (uv.x > 1) uv.x = 1;
-                if (uv.y < 0) uv.y = 0; if (uv.y > 1) uv.y = 1;
+            bool covered = (e0 + min0 > s.thr0 && e1 + min1 > s.thr1 && e2 + min2 > s.thr2);
+            if (covered && stats)
+                stats->blocks_covered++;
+            return covered ? 1 : 0;
+        };
+
+        // Consecutive blocks of the same class are drawn as one rectangle,
+        // so the spans stay long (8 pixel spans would waste the SSE setup)
+        int bx = firstBx;
+        int type = classifyBlock(bx);
+        while (bx <= lastBx)
+        {
+            int end = bx;
+            int next = type;
+            while (end < lastBx)
+            {
+                next = classifyBlock(end + 1);
+                if (next != type)
+                    break;
+                end++;
+            }
 
-                int tx = (int)(uv.x * (t.texture->width  - 1));
-                int ty = (int)(uv.y * (t.texture->height - 1));
+            if (type >= 0)
+            {
+                bool wroteDepth = rasterRect(std::max(bx * B, minX), y0, std::min(end * B + B - 1, maxX), y1, type == 1);
 
-                Color texColor = t.texture->GetPixel(tx, ty);
-                SetPixel(x, y, texColor);
+                // The blocks are still in cache, so refresh their max right away
+                if (hiz && wroteDepth)
+                    for (int k = bx; k <= end; ++k)
+                        hiz->UpdateBlock(*zbuffer, k, by);
             }
-            else // if no texture, compue the color by barycentric interpolation (simple)
+
+            bx = end + 1;
+            type = next;
+        }
+    }
+}
+
+void Image::DrawTriangleInterpolated(const sTriangleInfo& t, FloatImage* zbuffer)
+{
+    DrawTriangleInterpolated(t, zbuffer, 0, 0, (int)width - 1, (int)height - 1);
+}
+
+void Image::DrawTriangleInterpolated(const sTriangleInfo& t, FloatImage* zbuffer, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats)
+{
+    RasterTriangle<false>(*this, t, zbuffer, NULL, 0, clipMinX, clipMinY, clipMaxX, clipMaxY, stats);
+}
+
+void Image::DrawTriangleVisibility(const sTriangleInfo& t, unsigned int id, FloatImage* zbuffer, unsigned int* ids, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats)
+{
+    RasterTriangle<true>(*this, t, zbuffer, ids, id, clipMinX, clipMinY, clipMaxX, clipMaxY, stats);
+}
+
+void Image::ShadeVisibility(const sTriangleInfo* triangles, const unsigned int* ids, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats)
+{
+    // Neighbour pixels usually belong to the same triangle, so the setup is only redone when the id changes
+    unsigned int lastId = 0;
+    const sTriangleInfo* t = NULL;
+    sRasterSetup s;
+
+    for (int y = clipMinY; y <= clipMaxY; ++y)
+    {
+        const unsigned int* idRow = ids + y * width;
+        Color* colorRow = pixels + y * width;
+
+        for (int x = clipMinX; x <= clipMaxX; ++x)
+        {
+            unsigned int id = idRow[x];
+            if (id == 0)
+                continue;
+
+            if (id != lastId)
             {
-                Color c = t.c0 * alpha + t.c1 * beta + t.c2 * gamma;
-                SetPixel(x, y, c);
+                t = &triangles[id - 1];
+                s.doTexture = (t->useTexture && t->texture != NULL);
+                SetupPlanes(*t, s); // the triangle has area, it already covered this pixel
+                lastId = id;
             }
+
+            // Same planes and pixel centers the forward path uses
+            colorRow[x] = ShadeFragment(s, x, y);
+
+            if (stats)
+                stats->shaded++;
         }
     }
 }
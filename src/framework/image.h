@@ -16,19 +16,54 @@
 #pragma warning(disable:4996)
 #endif
 
+// SSE2 is always there on x86-64 (and on 32-bit builds that enable it), other CPUs use the scalar loops only
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define RASTER_SSE
+	#include <emmintrin.h>
+#endif
+
 //forward declaration for some functions in class Image
 class FloatImage;
 class Entity;
 class Camera;
 class Image;
 
+// How a texture is filtered and addressed when drawing a triangle (see sampler.h)
+struct sSamplerState
+{
+    enum eFilter { NEAREST, BILINEAR, TRILINEAR };
+    enum eWrap { CLAMP, REPEAT, MIRROR };
+    eFilter filter = TRILINEAR;
+    eWrap wrap = CLAMP;
+};
+
 struct sTriangleInfo
 {
     Vector3 p0, p1, p2;   // Screen coordinates (x,y) and depth (z)
     Vector2 uv0, uv1, uv2; // Texture coordinates
     Color c0, c1, c2;     // Not needed for texture, but useful for debugging
+    float w0 = 1.0f, w1 = 1.0f, w2 = 1.0f; // Clip space w of each vertex, for perspective correct attributes (1 = linear on screen)
     Image* texture;       // Texture image
     bool useTexture = true; // If false -> use interpolated vertex colors instead
+    sSamplerState sampler;  // Filter and wrap mode of the texture
+};
+
+// Counters filled by the rasterizer (optional)
+struct sRasterStats
+{
+    unsigned long long triangles = 0;        // Triangles that reached pixel setup
+    unsigned long long fragments = 0;        // Pixels that passed coverage and depth
+    unsigned long long shaded = 0;           // Pixels whose color was computed (fewer than fragments with the visibility buffer)
+    unsigned long long overdraw_removed = 0; // Pixels on shared edges that only the top-left rule skipped (not counted in blocks hidden by the HiZ)
+    unsigned long long blocks_rejected = 0;  // 8x8 blocks of big triangles skipped because they are outside
+    unsigned long long blocks_covered = 0;   // 8x8 blocks fully inside, drawn without coverage tests
+
+    void Clear() { triangles = fragments = shaded = overdraw_removed = blocks_rejected = blocks_covered = 0; }
+    void Add(const sRasterStats& o)
+    {
+        triangles += o.triangles; fragments += o.fragments; shaded += o.shaded; overdraw_removed += o.overdraw_removed;
+        blocks_rejected += o.blocks_rejected; blocks_covered += o.blocks_covered;
+    }
 };
 
 // A matrix of pixels
@@ -49,6 +84,21 @@ public:
 
 	Color* pixels;
 
+	// Mipmaps for textures: halved copies down to 1x1 (mipmaps[0] is level 1).
+	// Empty until BuildMipmaps, and dropped when the pixels are replaced (copies don't carry them)
+	std::vector<Image*> mipmaps;
+
+	// Texel layout: row-major by default. Swizzled images store 8x8 tiles (rows of tiles) with the pixels
+	// of each tile in Z-order, so neighbours in x and y are close in memory whatever direction a texture is read.
+	// The storage is padded to a multiple of 8 in both axes. Get/SetPixel understand both layouts.
+	bool swizzled = false;
+
+	// Block compressed storage (BC1 style): 8 bytes per 4x4 pixels, two RGB565 end colors plus a 2 bit index
+	// per pixel into the 4 colors of the line between them, 6x smaller than the Color pixels.
+	// Compressed images have no pixels and are read only: GetPixel decodes the texel, the functions that
+	// write pixels need Decompress() first (Resize, Scale and the loaders just drop the blocks).
+	unsigned char* blocks = NULL;
+
 	// Constructors
 	Image();
 	Image(unsigned int width, unsigned int height);
@@ -60,26 +110,89 @@ public:
 
 	void Render();
 
+	// Index of pixel x,y inside the pixels array. In both layouts it is the sum of a part that only depends
+	// on x and one that only depends on y (the bits of x and y don't overlap), filters reuse them for neighbour texels
+	inline unsigned int PixelIndex(unsigned int x, unsigned int y) const { return PixelIndexX(x) + PixelIndexY(y); }
+	inline unsigned int PixelIndexX(unsigned int x) const { return swizzled ? LayoutIndexX<true>(x) : LayoutIndexX<false>(x); }
+	inline unsigned int PixelIndexY(unsigned int y) const { return swizzled ? LayoutIndexY<true>(y) : LayoutIndexY<false>(y); }
+	// Same for a layout known at compile time (the samplers are specialized per layout), no branch on swizzled
+	template <bool SWIZZLED> inline unsigned int LayoutIndexX(unsigned int x) const { return SWIZZLED ? ((x >> 3) << 6) | SpreadBits(x & 7) : x; }
+	template <bool SWIZZLED> inline unsigned int LayoutIndexY(unsigned int y) const { return SWIZZLED ? (((y >> 3) * ((width + 7) >> 3)) << 6) | (SpreadBits(y & 7) << 1) : y * width; }
+	static inline unsigned int SpreadBits(unsigned int v) { static const unsigned char spread[8] = { 0, 1, 4, 5, 16, 17, 20, 21 }; return spread[v]; } // 3 bits -> even bits
+	unsigned int GetStorageSize() const { return swizzled ? ((width + 7) & ~7u) * ((height + 7) & ~7u) : width * height; } // In pixels
+
+	// Convert the pixels (and the mipmaps) to the swizzled layout or back to row-major
+	void SetSwizzled(bool enable);
+
+	// Encode the pixels (and the mipmaps) into blocks and release them, or go back to pixels (in the current layout)
+	void Compress();
+	void Decompress();
+	bool IsCompressed() const { return blocks != NULL; }
+
+	// The 8 bytes of the block that contains pixel x,y
+	const unsigned char* GetBlock(unsigned int x, unsigned int y) const { return blocks + (((y >> 2) * ((width + 3) >> 2) + (x >> 2)) << 3); }
+
+	// The 4 colors of a block (same rules as BC1: c0 > c1 gives 2 colors in between, otherwise the middle one and black)
+	static inline void DecodeBlockColors(const unsigned char* block, Color colors[4])
+	{
+		unsigned int c0 = block[0] | (block[1] << 8), c1 = block[2] | (block[3] << 8);
+		unsigned int r0 = c0 >> 11, g0 = (c0 >> 5) & 63, b0 = c0 & 31;
+		unsigned int r1 = c1 >> 11, g1 = (c1 >> 5) & 63, b1 = c1 & 31;
+		r0 = (r0 << 3) | (r0 >> 2); g0 = (g0 << 2) | (g0 >> 4); b0 = (b0 << 3) | (b0 >> 2);
+		r1 = (r1 << 3) | (r1 >> 2); g1 = (g1 << 2) | (g1 >> 4); b1 = (b1 << 3) | (b1 >> 2);
+
+		colors[0].r = (unsigned char)r0; colors[0].g = (unsigned char)g0; colors[0].b = (unsigned char)b0;
+		colors[1].r = (unsigned char)r1; colors[1].g = (unsigned char)g1; colors[1].b = (unsigned char)b1;
+		if (c0 > c1)
+		{
+			colors[2].r = (unsigned char)((2 * r0 + r1) / 3); colors[2].g = (unsigned char)((2 * g0 + g1) / 3); colors[2].b = (unsigned char)((2 * b0 + b1) / 3);
+			colors[3].r = (unsigned char)((r0 + 2 * r1) / 3); colors[3].g = (unsigned char)((g0 + 2 * g1) / 3); colors[3].b = (unsigned char)((b0 + 2 * b1) / 3);
+		}
+		else
+		{
+			colors[2].r = (unsigned char)((r0 + r1) / 2); colors[2].g = (unsigned char)((g0 + g1) / 2); colors[2].b = (unsigned char)((b0 + b1) / 2);
+			colors[3] = Color(); // black
+		}
+	}
+
+	// Index (0..3) of pixel x,y inside its block: 2 bits per pixel, row by row
+	static inline unsigned int BlockIndex(const unsigned char* block, unsigned int x, unsigned int y) { return (block[4 + (y & 3)] >> ((x & 3) * 2)) & 3; }
+
+	// Bytes used by the pixels or the blocks, mipmaps included
+	size_t GetMemorySize() const;
+
 	// Get the pixel at position x,y
-	Color GetPixel(unsigned int x, unsigned int y) const { return pixels[ y * width + x ]; }
-	Color& GetPixelRef(unsigned int x, unsigned int y)	{ return pixels[ y * width + x ]; }
+	Color GetPixel(unsigned int x, unsigned int y) const { return blocks ? GetBlockPixel(x, y) : pixels[ PixelIndex(x, y) ]; }
+	Color& GetPixelRef(unsigned int x, unsigned int y)	{ return pixels[ PixelIndex(x, y) ]; }
 	Color GetPixelSafe(unsigned int x, unsigned int y) const {	
 		x = clamp((unsigned int)x, 0, width-1); 
 		y = clamp((unsigned int)y, 0, height-1); 
-		return pixels[ y * width + x ]; 
+		return GetPixel(x, y); 
+	}
+	Color GetBlockPixel(unsigned int x, unsigned int y) const {
+		const unsigned char* block = GetBlock(x, y);
+		Color colors[4];
+		DecodeBlockColors(block, colors);
+		return colors[BlockIndex(block, x, y)];
 	}
 
 	// Set the pixel at position x,y with value C
-	void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; pixels[ y * width + x ] = c; }
-	inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { pixels[ y * width + x ] = c; }
+	void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; pixels[ PixelIndex(x, y) ] = c; }
+	inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { pixels[ PixelIndex(x, y) ] = c; }
 
 	void Resize(unsigned int width, unsigned int height);
 	void Scale(unsigned int width, unsigned int height);
 	
 	void FlipY(); // Flip the image top-down
 
+	// Build the mip pyramid from the current pixels (2x2 box filter), call it once after loading a texture
+	void BuildMipmaps();
+	void ClearMipmaps();
+	int GetNumMipmaps() const { return 1 + (int)mipmaps.size(); } // Level 0 is the image itself
+	const Image* GetMipmap(int level) const { return level <= 0 ? this : mipmaps[level - 1]; }
+
 	// Fill the image with the color C
-	void Fill(const Color& c) { for(unsigned int pos = 0; pos < width*height; ++pos) pixels[pos] = c; }
+	void Fill(const Color& c) { if (blocks) Decompress(); unsigned int size = GetStorageSize(); for(unsigned int pos = 0; pos < size; ++pos) pixels[pos] = c; }
     
     // Draw line function
     void DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c);
@@ -107,6 +220,14 @@ public:
     
     //lab 3.2
     void DrawTriangleInterpolated(const sTriangleInfo& triangle, FloatImage* zbuffer);
+    // Same, but only touches the pixels inside [clipMinX, clipMaxX] x [clipMinY, clipMaxY] (used by the tile rasterizer)
+    void DrawTriangleInterpolated(const sTriangleInfo& triangle, FloatImage* zbuffer, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats = NULL);
+
+    // Visibility buffer (two passes). ids has one entry per pixel of this image, 0 means empty.
+    // First pass: only depth test and store the id of the triangle, nothing is shaded
+    void DrawTriangleVisibility(const sTriangleInfo& triangle, unsigned int id, FloatImage* zbuffer, unsigned int* ids, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats = NULL);
+    // Second pass: shade every pixel of the rectangle once, with the triangle triangles[id - 1]
+    void ShadeVisibility(const sTriangleInfo* triangles, const unsigned int* ids, int clipMinX, int clipMinY, int clipMaxX, int clipMaxY, sRasterStats* stats = NULL);
 
 	// Used to easy code
 	#ifndef IGNORE_LAMBDAS
@@ -117,13 +238,45 @@ public:
 	template <typename F>
 	Image& ForEachPixel( F callback )
 	{
-		for(unsigned int pos = 0; pos < width*height; ++pos)
+		unsigned int size = GetStorageSize();
+		for(unsigned int pos = 0; pos < size; ++pos)
 			pixels[pos] = callback(pixels[pos]);
 		return *this;
 	}
 	#endif
 };
 
+// Hierarchical z-buffer: max depth per 8x8 block and per 64x64 tile of a FloatImage.
+// Depth only goes down while drawing, so an old max is still a valid (conservative) bound.
+// Written areas are marked dirty and their max is recomputed when it is asked for.
+class HiZBuffer
+{
+public:
+	static const int BLOCK_SIZE = 8;
+	static const int TILE_SIZE = 64; // Same as Rasterizer::TILE_SIZE so each thread only touches its own tiles
+
+	unsigned int blocks_x = 0, blocks_y = 0;
+	unsigned int tiles_x = 0, tiles_y = 0;
+
+	std::vector<float> block_max;
+	std::vector<unsigned char> block_dirty;
+	std::vector<float> tile_max;
+	std::vector<unsigned char> tile_dirty;
+
+	void Resize(unsigned int width, unsigned int height);
+	void Reset(float v); // The whole z-buffer was filled with v
+
+	// Pixels inside the rectangle have been written
+	void MarkDirty(int minX, int minY, int maxX, int maxY);
+
+	float GetBlockMax(const FloatImage& zbuffer, int bx, int by);
+	void UpdateBlock(const FloatImage& zbuffer, int bx, int by); // Recompute the max of a block now
+	float GetTileMax(const FloatImage& zbuffer, int tx, int ty);
+
+	// True if no pixel of the rectangle can pass a depth test with depth >= minZ
+	bool IsOccluded(const FloatImage& zbuffer, int minX, int minY, int maxX, int maxY, float minZ);
+};
+
 // Image storing one float per pixel instead of a 3 or 4 component Color
 class FloatImage
 {
@@ -132,8 +285,11 @@ public:
 	unsigned int height;
 	float* pixels;
 
+	// Optional hierarchical z kept next to the pixels (NULL if disabled)
+	HiZBuffer* hiz;
+
 	// CONSTRUCTORS 
-	FloatImage() { width = height = 0; pixels = NULL; }
+	FloatImage() { width = height = 0; pixels = NULL; hiz = NULL; }
 	FloatImage(unsigned int width, unsigned int height);
 	FloatImage(const FloatImage& c);
 	FloatImage& operator = (const FloatImage& c); //assign operator
@@ -141,7 +297,7 @@ public:
 	//destructor
 	~FloatImage();
 
-	void Fill(const float& v) { for (unsigned int pos = 0; pos < width * height; ++pos) pixels[pos] = v; }
+	void Fill(const float& v);
 
 	//get the pixel at position x,y
 	float GetPixel(unsigned int x, unsigned int y) const { return pixels[y * width + x]; }
@@ -152,4 +308,6 @@ public:
 	inline void SetPixelUnsafe(unsigned int x, unsigned int y, const float& v) { pixels[y * width + x] = v; }
 
 	void Resize(unsigned int width, unsigned int height);
+
+	void EnableHiZ(bool enable);
 };
@@ -0,0 +1,120 @@
+#include "imageregistry.h"
+
+#include <iostream>
+
+ImageRegistry::~ImageRegistry()
+{
+	for (std::map<std::string, sEntry>::iterator it = entries.begin(); it != entries.end(); ++it)
+		delete it->second.image;
+}
+
+Image* ImageRegistry::Acquire(const char* filename, const sImageLoadOptions& options)
+{
+	std::string name = std::string(filename);
+	std::map<std::string, sEntry>::iterator it = entries.find(name);
+	if (it != entries.end())
+	{
+		hits++;
+		it->second.refs++;
+		Touch(it->second);
+		return it->second.image;
+	}
+
+	// Extension picks the loader (same formats as the rest of the framework)
+	Image* image = new Image();
+	bool png = name.size() >= 4 && name.compare(name.size() - 4, 4, ".png") == 0;
+	bool ok = png ? image->LoadPNG(filename, options.flipY) : image->LoadTGA(filename, options.flipY);
+	if (!ok)
+	{
+		delete image;
+		return NULL;
+	}
+
+	if (options.mipmaps)
+		image->BuildMipmaps();
+	image->SetSwizzled(options.swizzled);
+	if (options.compressed)
+		image->Compress();
+
+	loads++;
+	sEntry entry;
+	entry.image = image;
+	entry.refs = 1;
+	entry.lru = lru.insert(lru.begin(), name);
+	entries[name] = entry;
+	paths[image] = name;
+
+	// The new image is referenced, so only older unused ones can make room for it
+	Evict();
+	return image;
+}
+
+void ImageRegistry::Release(Image* image)
+{
+	if (!image) // Acquire failed, nothing to release
+		return;
+
+	std::map<const Image*, std::string>::iterator it = paths.find(image);
+	if (it == paths.end())
+	{
+		std::cout << "ImageRegistry: releasing an image that is not in the registry" << std::endl;
+		return;
+	}
+
+	sEntry& entry = entries[it->second];
+	if (entry.refs <= 0)
+	{
+		std::cout << "ImageRegistry: too many releases of " << it->second << std::endl;
+		return;
+	}
+
+	// Unused from now on, the lru order is the time it was last used
+	entry.refs--;
+	Touch(entry);
+	Evict();
+}
+
+void ImageRegistry::SetBudget(size_t bytes)
+{
+	budget = bytes;
+	Evict();
+}
+
+size_t ImageRegistry::GetResidentBytes() const
+{
+	// Summed on demand: SetSwizzled or Compress on a registered image change its size
+	size_t bytes = 0;
+	for (std::map<std::string, sEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		bytes += it->second.image->GetMemorySize();
+	return bytes;
+}
+
+void ImageRegistry::Touch(sEntry& entry)
+{
+	lru.splice(lru.begin(), lru, entry.lru);
+}
+
+void ImageRegistry::Evict()
+{
+	if (budget == 0)
+		return;
+
+	size_t bytes = GetResidentBytes();
+
+	// From the least recently used, skipping the ones still referenced
+	std::list<std::string>::iterator it = lru.end();
+	while (bytes > budget && it != lru.begin())
+	{
+		--it;
+		sEntry& entry = entries[*it];
+		if (entry.refs > 0)
+			continue;
+
+		bytes -= entry.image->GetMemorySize();
+		paths.erase(entry.image);
+		delete entry.image;
+		entries.erase(*it);
+		it = lru.erase(it);
+		evictions++;
+	}
+}
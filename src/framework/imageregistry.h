@@ -0,0 +1,68 @@
+/*
+	+ Registry of the CPU images used as textures by the software rasterizer, keyed by file path.
+	+ Loading the same path twice gives the same Image (loaded and processed only once). Every
+	  Acquire adds a reference and every Release removes one.
+	+ Images without references stay loaded (so reloading a scene is free) until the memory budget
+	  needs their bytes, then the least recently used ones are deleted first. Referenced images are
+	  never evicted, so the resident memory can go over the budget if the scene alone needs more.
+*/
+
+#pragma once
+
+#include <map>
+#include <list>
+#include <string>
+#include "image.h"
+
+// What is done to an image after loading it. Only used the first time a path is loaded,
+// later Acquires of the same path get the image as it was processed then.
+struct sImageLoadOptions
+{
+	bool flipY = true;       // Loaded images have (0,0) at the bottom like the framebuffer
+	bool mipmaps = true;     // BuildMipmaps
+	bool swizzled = true;    // SetSwizzled
+	bool compressed = false; // Compress (BC1 blocks)
+};
+
+class ImageRegistry
+{
+public:
+	~ImageRegistry();
+
+	// Image of the file with one more reference, NULL if it can't be loaded
+	Image* Acquire(const char* filename, const sImageLoadOptions& options = sImageLoadOptions());
+
+	// Drops a reference of an image returned by Acquire. It stays loaded until the budget evicts it.
+	void Release(Image* image);
+
+	// Max bytes of the loaded images (0 = no limit). Lowering it evicts right away.
+	void SetBudget(size_t bytes);
+	size_t GetBudget() const { return budget; }
+
+	// Memory of all the loaded images (pixels or blocks plus mipmaps)
+	size_t GetResidentBytes() const;
+	int GetNumImages() const { return (int)entries.size(); }
+
+	// Counters since the registry was created
+	int hits = 0;      // Acquires that found the image loaded
+	int loads = 0;     // Acquires that loaded the file
+	int evictions = 0; // Images deleted to fit in the budget
+
+private:
+	struct sEntry
+	{
+		Image* image;
+		int refs;
+		std::list<std::string>::iterator lru; // Position in the lru list
+	};
+
+	std::map<std::string, sEntry> entries;
+	std::map<const Image*, std::string> paths; // Image -> key, so Release can take the pointer
+	std::list<std::string> lru;                // Most recently used first
+	size_t budget = 0;
+
+	void Touch(sEntry& entry);
+
+	// Delete unreferenced images (least recently used first) until the resident bytes fit in the budget
+	void Evict();
+};
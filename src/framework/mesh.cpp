@@ -5,16 +5,49 @@
 #include <string>
 #include <sys/stat.h>
 #include <cstring>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+#ifdef WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX // std::min/max
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
 
 Mesh::Mesh()
 {
 }
 
+Mesh::~Mesh()
+{
+	ClearLODs();
+}
+
 void Mesh::Clear()
 {
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	indices.clear();
+	meshlets.clear();
+	meshlet_vertices.clear();
+	meshlet_triangles.clear();
+	ClearLODs();
+}
+
+void Mesh::ClearLODs()
+{
+	for (size_t i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
 }
 
 void Mesh::Render(int primitive)
@@ -37,7 +70,10 @@ void Mesh::Render(int primitive)
 		glTexCoordPointer(2, GL_FLOAT, 0, &uvs[0]);
 	}
 
-	glDrawArrays(primitive, 0, static_cast<GLsizei>(vertices.size()));
+	if (indices.size())
+		glDrawElements(primitive, static_cast<GLsizei>(indices.size()), GL_UNSIGNED_INT, &indices[0]);
+	else
+		glDrawArrays(primitive, 0, static_cast<GLsizei>(vertices.size()));
 	glDisableClientState(GL_VERTEX_ARRAY);
 
 	if (normals.size())
@@ -67,6 +103,8 @@ void Mesh::CreateQuad()
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	UpdateBounds();
 }
 
 void Mesh::CreatePlane(float size)
@@ -99,6 +137,8 @@ void Mesh::CreatePlane(float size)
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	UpdateBounds();
 }
 
 void Mesh::CreateCube(float size)
@@ -236,113 +276,1542 @@ void Mesh::CreateCube(float size)
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	UpdateBounds();
 }
 
-bool Mesh::LoadOBJ(const char* filename)
+void Mesh::UpdateBounds()
 {
-	struct stat stbuffer;
-	std::cout << "Loading mesh: " << filename << std::endl;
+	aabb_min = aabb_max = vertices.empty() ? Vector3(0, 0, 0) : vertices[0];
+	for (size_t i = 1; i < vertices.size(); ++i)
+	{
+		const Vector3& v = vertices[i];
+		aabb_min.x = std::min(aabb_min.x, v.x); aabb_max.x = std::max(aabb_max.x, v.x);
+		aabb_min.y = std::min(aabb_min.y, v.y); aabb_max.y = std::max(aabb_max.y, v.y);
+		aabb_min.z = std::min(aabb_min.z, v.z); aabb_max.z = std::max(aabb_max.z, v.z);
+	}
 
-	std::string relPath = absResPath(filename);
+	// Centered in the box: not the smallest sphere, but close for the usual meshes and a single pass
+	sphere_center = (aabb_min + aabb_max) * 0.5f;
+	float radius2 = 0.0f;
+	for (size_t i = 0; i < vertices.size(); ++i)
+	{
+		Vector3 d = vertices[i] - sphere_center;
+		radius2 = std::max(radius2, d.x * d.x + d.y * d.y + d.z * d.z);
+	}
+	sphere_radius = sqrtf(radius2);
+}
 
-	FILE* f = fopen(relPath.c_str(), "rb");
-	if (f == NULL)
+// Bounding sphere and normal cone of a meshlet (the cone as in meshoptimizer's computeClusterBounds)
+static void ComputeMeshletBounds(sMeshlet& meshlet, const Vector3* positions, const unsigned int* meshletVertices, const unsigned char* triangles)
+{
+	// Sphere centered in the box of its vertices
+	Vector3 minP = positions[meshletVertices[0]], maxP = minP;
+	for (unsigned int i = 1; i < meshlet.num_vertices; ++i)
 	{
-		std::cerr << "File not found: " << filename << std::endl;
-		return false;
+		const Vector3& p = positions[meshletVertices[i]];
+		minP.x = std::min(minP.x, p.x); maxP.x = std::max(maxP.x, p.x);
+		minP.y = std::min(minP.y, p.y); maxP.y = std::max(maxP.y, p.y);
+		minP.z = std::min(minP.z, p.z); maxP.z = std::max(maxP.z, p.z);
+	}
+	meshlet.center = (minP + maxP) * 0.5f;
+	float radius2 = 0.0f;
+	for (unsigned int i = 0; i < meshlet.num_vertices; ++i)
+	{
+		Vector3 d = positions[meshletVertices[i]] - meshlet.center;
+		radius2 = std::max(radius2, d.x * d.x + d.y * d.y + d.z * d.z);
 	}
+	meshlet.radius = sqrtf(radius2);
 
-	stat(relPath.c_str(), &stbuffer);
+	// Unit normals of the triangles (front faces are counter-clockwise), the axis is their average
+	Vector3 normals[Mesh::MESHLET_MAX_TRIANGLES], corners[Mesh::MESHLET_MAX_TRIANGLES];
+	int count = 0;
+	Vector3 axis(0, 0, 0);
+	for (unsigned int t = 0; t < meshlet.num_triangles; ++t)
+	{
+		const Vector3& p0 = positions[meshletVertices[triangles[t * 3]]];
+		Vector3 n = (positions[meshletVertices[triangles[t * 3 + 1]]] - p0).Cross(positions[meshletVertices[triangles[t * 3 + 2]]] - p0);
+		float length = n.Length();
+		if (length == 0.0f) // Degenerate triangles are never drawn, they don't count
+			continue;
+		normals[count] = n * (1.0f / length);
+		corners[count] = p0;
+		axis = axis + normals[count];
+		count++;
+	}
 
-	unsigned int size = stbuffer.st_size;
-	char* data = new char[size + 1];
-	fread(data, size, 1, f);
-	fclose(f);
-	data[size] = 0;
+	meshlet.cone_apex = meshlet.center;
+	meshlet.cone_axis = Vector3(0, 0, 0);
+	meshlet.cone_cutoff = 2.0f; // No point passes the test
+
+	float axisLength = axis.Length();
+	if (axisLength == 0.0f)
+		return;
+	axis = axis * (1.0f / axisLength);
+
+	// Cosine of the widest angle between a normal and the axis. Cones of ~170 degrees or more are useless.
+	float mindp = 1.0f;
+	for (int t = 0; t < count; ++t)
+		mindp = std::min(mindp, axis.Dot(normals[t]));
+	if (mindp <= 0.1f)
+		return;
+
+	// Apex: the point of the center - t * axis ray that is behind the planes of all the triangles
+	float maxt = 0.0f;
+	for (int t = 0; t < count; ++t)
+	{
+		float dc = (meshlet.center - corners[t]).Dot(normals[t]);
+		float dn = axis.Dot(normals[t]);
+		maxt = std::max(maxt, dc / dn);
+	}
+	meshlet.cone_apex = meshlet.center - axis * maxt;
+	meshlet.cone_axis = axis;
+	meshlet.cone_cutoff = sqrtf(1.0f - mindp * mindp); // sin of the normal cone angle: the view cone is 90 degrees wider
+}
+
+void Mesh::BuildMeshlets()
+{
+	meshlets.clear();
+	meshlet_vertices.clear();
+	meshlet_triangles.clear();
+	if (indices.empty() || vertices.empty())
+		return;
+
+	size_t numTriangles = indices.size() / 3;
+
+	// Unused triangles of every vertex: adjacencyOffsets[v] to adjacencyEnd[v] in adjacency
+	std::vector<unsigned int> adjacencyOffsets(vertices.size() + 1, 0), adjacency(numTriangles * 3);
+	for (size_t i = 0; i < numTriangles * 3; ++i)
+		adjacencyOffsets[indices[i] + 1]++;
+	for (size_t v = 0; v < vertices.size(); ++v)
+		adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+	std::vector<unsigned int> adjacencyEnd(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+	for (size_t i = 0; i < numTriangles * 3; ++i)
+		adjacency[adjacencyEnd[indices[i]]++] = (unsigned int)(i / 3);
+
+	// Unit normal of every triangle (0 for the degenerate ones)
+	std::vector<float> triangleNormals(numTriangles * 3);
+	for (size_t t = 0; t < numTriangles; ++t)
+	{
+		const Vector3& p0 = vertices[indices[t * 3]];
+		const Vector3& p1 = vertices[indices[t * 3 + 1]];
+		const Vector3& p2 = vertices[indices[t * 3 + 2]];
+		float ax = p1.x - p0.x, ay = p1.y - p0.y, az = p1.z - p0.z;
+		float bx = p2.x - p0.x, by = p2.y - p0.y, bz = p2.z - p0.z;
+		float nx = ay * bz - az * by, ny = az * bx - ax * bz, nz = ax * by - ay * bx;
+		float length = sqrtf(nx * nx + ny * ny + nz * nz);
+		float scale = length > 0.0f ? 1.0f / length : 0.0f;
+		triangleNormals[t * 3] = nx * scale; triangleNormals[t * 3 + 1] = ny * scale; triangleNormals[t * 3 + 2] = nz * scale;
+	}
+
+	// Meshlets grow from a seed through the triangles around the last one added, taking the one that adds
+	// fewer vertices and, between similar ones, the one that faces more like the meshlet so far (tighter
+	// normal cones). With no unused neighbours it goes on with the next unused triangle in index order; the
+	// seeds go in that order too, so the meshlets keep roughly the order given by OptimizeTriangleOrder.
+	const float CONE_WEIGHT = 0.5f;
+	std::vector<int> local(vertices.size(), -1); // Local index of a mesh vertex in the open meshlet
+	std::vector<char> used(numTriangles, 0);
+	size_t cursor = 0;                           // Unused triangles are all at or after it
+	meshlet_triangles.reserve(indices.size());
+
+	sMeshlet meshlet = {};
+	float normalSum[3] = { 0.0f, 0.0f, 0.0f };
+	unsigned int last = 0;
+
+	auto newVertices = [&](unsigned int t)
+	{
+		unsigned int a = indices[t * 3], b = indices[t * 3 + 1], c = indices[t * 3 + 2];
+		return (local[a] < 0) + (local[b] < 0 && b != a) + (local[c] < 0 && c != a && c != b);
+	};
+
+	auto add = [&](unsigned int t)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = indices[t * 3 + k];
+			if (local[v] < 0)
+			{
+				local[v] = (int)meshlet.num_vertices++;
+				meshlet_vertices.push_back(v);
+			}
+			meshlet_triangles.push_back((unsigned char)local[v]);
+		}
+		for (int k = 0; k < 3; ++k)
+			normalSum[k] += triangleNormals[t * 3 + k];
+		meshlet.num_triangles++;
+		used[t] = 1;
+		last = t;
+	};
+
+	auto close = [&]()
+	{
+		ComputeMeshletBounds(meshlet, vertices.data(), &meshlet_vertices[meshlet.first_vertex], &meshlet_triangles[meshlet.first_triangle * 3]);
+		meshlets.push_back(meshlet);
+		for (unsigned int i = 0; i < meshlet.num_vertices; ++i)
+			local[meshlet_vertices[meshlet.first_vertex + i]] = -1;
+		meshlet.first_vertex += meshlet.num_vertices;
+		meshlet.first_triangle += meshlet.num_triangles;
+		meshlet.num_vertices = meshlet.num_triangles = 0;
+		normalSum[0] = normalSum[1] = normalSum[2] = 0.0f;
+	};
+
+	while (true)
+	{
+		int next = -1;
+		if (meshlet.num_triangles > 0)
+		{
+			float length = sqrtf(normalSum[0] * normalSum[0] + normalSum[1] * normalSum[1] + normalSum[2] * normalSum[2]);
+			float scale = length > 0.0f ? 1.0f / length : 0.0f;
+			float axis[3] = { normalSum[0] * scale, normalSum[1] * scale, normalSum[2] * scale };
+
+			float bestScore = 1e9f;
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = indices[last * 3 + k];
+				for (unsigned int j = adjacencyOffsets[v]; j < adjacencyEnd[v]; ++j)
+				{
+					unsigned int t = adjacency[j];
+					if (used[t]) // Not a candidate anymore, out of the list so it is not checked again
+					{
+						adjacency[j--] = adjacency[--adjacencyEnd[v]];
+						continue;
+					}
+					const float* n = &triangleNormals[t * 3];
+					float score = (float)newVertices(t) + CONE_WEIGHT * (1.0f - (axis[0] * n[0] + axis[1] * n[1] + axis[2] * n[2]));
+					if (score < bestScore)
+					{
+						bestScore = score;
+						next = (int)t;
+					}
+				}
+			}
+		}
+		if (next < 0)
+		{
+			while (cursor < numTriangles && used[cursor])
+				cursor++;
+			if (cursor == numTriangles)
+				break;
+			next = (int)cursor;
+		}
+
+		if (meshlet.num_vertices + newVertices(next) > MESHLET_MAX_VERTICES || meshlet.num_triangles + 1 > MESHLET_MAX_TRIANGLES)
+			close();
+		add(next);
+	}
+	if (meshlet.num_triangles > 0)
+		close();
+}
+
+size_t Mesh::GetMemorySize() const
+{
+	return vertices.size() * sizeof(Vector3) + normals.size() * sizeof(Vector3) +
+	       uvs.size() * sizeof(Vector2) + indices.size() * sizeof(unsigned int);
+}
+
+// Misses of a FIFO cache of cacheSize vertices while the triangles of indices are drawn in order.
+// stamp keeps, per vertex, the miss count when it entered the cache (so it is still cached while misses - stamp < cacheSize).
+static size_t CountCacheMisses(const unsigned int* indices, size_t count, size_t numVertices, int cacheSize)
+{
+	std::vector<long long> stamp(numVertices, -(long long)cacheSize - 1);
+	long long misses = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		unsigned int v = indices[i];
+		if (misses - stamp[v] >= cacheSize)
+			stamp[v] = misses++;
+	}
+	return (size_t)misses;
+}
 
-	char* pos = data;
-	char line[255];
-	int i = 0;
+float Mesh::GetACMR(int cacheSize) const
+{
+	if (indices.empty())
+		return vertices.empty() ? 0.0f : 3.0f; // Not indexed: nothing is shared
+	return (float)CountCacheMisses(&indices[0], indices.size(), vertices.size(), cacheSize) / (float)(indices.size() / 3);
+}
 
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
+// Tipsify (Sander, Nehab and Barczak, "Fast triangle reordering for vertex locality and reduced overdraw", 2007).
+// Fans around one vertex at a time, and the next vertex is a neighbour that is still in the cache and has
+// triangles left. When there is none (dead end) it jumps to the most recent vertex with triangles left, or
+// to the next one in the mesh. Jumps are stored in clusterStarts, the overdraw pass reorders those clusters.
+static std::vector<unsigned int> Tipsify(const std::vector<unsigned int>& indices, size_t numVertices, int cacheSize,
+                                         std::vector<size_t>& clusterStarts)
+{
+	size_t numTriangles = indices.size() / 3;
+
+	// Triangles of each vertex (CSR: the ones of v are adjacency[offsets[v]..offsets[v + 1]))
+	std::vector<unsigned int> live(numVertices, 0);
+	for (size_t i = 0; i < indices.size(); ++i)
+		live[indices[i]]++;
+	std::vector<size_t> offsets(numVertices + 1, 0);
+	for (size_t v = 0; v < numVertices; ++v)
+		offsets[v + 1] = offsets[v] + live[v];
+	std::vector<unsigned int> adjacency(indices.size());
+	std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < indices.size(); ++i)
+		adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
 
-	const float max_float = 10000000;
-	const float min_float = -10000000;
+	std::vector<int> cacheTime(numVertices, 0); // Time when the vertex entered the cache
+	std::vector<char> emitted(numTriangles, 0);
+	std::vector<unsigned int> deadEnd;             // Vertices of the emitted triangles, most recent last
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> out;
+	out.reserve(indices.size());
 
-	unsigned int vertex_i = 0;
+	int time = cacheSize + 1;
+	size_t cursor = 0; // Next vertex in mesh order to try when the dead end stack is empty
+	int fan = numVertices ? 0 : -1;
+	clusterStarts.assign(1, 0);
 
-	//parse file
-	while (*pos != 0)
+	while (fan >= 0)
 	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
+		candidates.clear();
+		for (size_t k = offsets[fan]; k < offsets[fan + 1]; ++k)
+		{
+			unsigned int t = adjacency[k];
+			if (emitted[t])
+				continue;
+			for (int c = 0; c < 3; ++c)
+			{
+				unsigned int v = indices[t * 3 + c];
+				out.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cacheTime[v] > cacheSize) // Not in the cache: it gets transformed now
+					cacheTime[v] = time++;
+			}
+			emitted[t] = 1;
+		}
 
-		//read one line
-		i = 0;
-		while (i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		std::memcpy(line, pos, i);
-		line[i] = 0;
-		pos = pos + i;
+		// Best neighbour: the one that stays longest in the cache after its remaining triangles are emitted
+		int next = -1, best = -1;
+		for (size_t k = 0; k < candidates.size(); ++k)
+		{
+			unsigned int v = candidates[k];
+			if (!live[v])
+				continue;
+			int priority = 0;
+			if (time - cacheTime[v] + 2 * (int)live[v] <= cacheSize)
+				priority = time - cacheTime[v];
+			if (priority > best)
+			{
+				best = priority;
+				next = (int)v;
+			}
+		}
 
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
+		if (next < 0)
+		{
+			// Dead end: most recent vertex with triangles left, else the next one in the mesh
+			while (!deadEnd.empty() && next < 0)
+			{
+				unsigned int v = deadEnd.back();
+				deadEnd.pop_back();
+				if (live[v])
+					next = (int)v;
+			}
+			while (next < 0 && cursor < numVertices)
+			{
+				if (live[cursor])
+					next = (int)cursor;
+				cursor++;
+			}
+			if (next >= 0 && out.size() / 3 > clusterStarts.back())
+				clusterStarts.push_back(out.size() / 3);
+		}
+		fan = next;
+	}
+	return out;
+}
 
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line, " ");
+// Renumber the vertices in the order the indices first use them and drop the ones no triangle uses
+static void CompactVertices(std::vector<unsigned int>& indices, std::vector<Vector3>& vertices, std::vector<Vector3>& normals, std::vector<Vector2>& uvs)
+{
+	std::vector<unsigned int> remap(vertices.size(), (unsigned int)-1);
+	unsigned int used = 0;
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		unsigned int& r = remap[indices[i]];
+		if (r == (unsigned int)-1)
+			r = used++;
+		indices[i] = r;
+	}
+
+	std::vector<Vector3> newVertices(used), newNormals(normals.empty() ? 0 : used);
+	std::vector<Vector2> newUVs(uvs.empty() ? 0 : used);
+	for (size_t v = 0; v < vertices.size(); ++v)
+	{
+		unsigned int r = remap[v];
+		if (r == (unsigned int)-1) // Not used by any triangle
+			continue;
+		newVertices[r] = vertices[v];
+		if (!normals.empty())
+			newNormals[r] = normals[v];
+		if (!uvs.empty())
+			newUVs[r] = uvs[v];
+	}
+	vertices.swap(newVertices);
+	normals.swap(newNormals);
+	uvs.swap(newUVs);
+}
+
+void Mesh::OptimizeTriangleOrder(int cacheSize)
+{
+	if (indices.size() < 3)
+		return;
+
+	size_t numTriangles = indices.size() / 3;
+	std::vector<size_t> starts;
+	std::vector<unsigned int> order = Tipsify(indices, vertices.size(), cacheSize, starts);
+
+	// Overdraw: the clusters of Tipsify are split a bit more where the cache is already warm (lambda
+	// keeps the ACMR at most 5% worse), then sorted so the ones facing away from the mesh center go
+	// first. Those are usually the outside surfaces that hide the rest, so more pixels fail the depth test.
+	const float lambda = 1.05f;
+	float acmr = (float)CountCacheMisses(&order[0], order.size(), vertices.size(), cacheSize) / (float)numTriangles;
+	std::vector<size_t> clusters;
+	starts.push_back(numTriangles);
+	for (size_t c = 0; c + 1 < starts.size(); ++c)
+	{
+		clusters.push_back(starts[c]);
+		std::vector<unsigned int> inCache;
+		size_t misses = 0, count = 0;
+		for (size_t t = starts[c]; t < starts[c + 1]; ++t)
+		{
+			// Only split between triangles, after the cluster has paid its first misses
+			if (count > 0 && (float)misses / (float)count <= lambda * acmr)
+			{
+				clusters.push_back(t);
+				inCache.clear();
+				misses = count = 0;
+			}
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int v = order[t * 3 + k];
+				if (std::find(inCache.begin(), inCache.end(), v) == inCache.end())
+				{
+					misses++;
+					inCache.push_back(v);
+					if ((int)inCache.size() > cacheSize)
+						inCache.erase(inCache.begin());
+				}
+			}
+			count++;
+		}
+	}
+	clusters.push_back(numTriangles);
+
+	// Area weighted centroid and normal of every cluster, and the centroid of the whole mesh
+	size_t numClusters = clusters.size() - 1;
+	std::vector<Vector3> centroids(numClusters), clusterNormals(numClusters);
+	Vector3 meshCentroid;
+	float meshArea = 0.0f;
+	for (size_t c = 0; c < numClusters; ++c)
+	{
+		Vector3 center, normal;
+		float area = 0.0f;
+		for (size_t t = clusters[c]; t < clusters[c + 1]; ++t)
+		{
+			const Vector3& a = vertices[order[t * 3]];
+			const Vector3& b = vertices[order[t * 3 + 1]];
+			const Vector3& d = vertices[order[t * 3 + 2]];
+			Vector3 n = (b - a).Cross(d - a); // Length is twice the area
+			float w = n.Length();
+			normal = normal + n;
+			center = center + (a + b + d) * (w / 3.0f);
+			area += w;
+		}
+		meshCentroid = meshCentroid + center;
+		meshArea += area;
+		centroids[c] = area > 0.0f ? center * (1.0f / area) : vertices[order[clusters[c] * 3]];
+		clusterNormals[c] = normal;
+	}
+	if (meshArea > 0.0f)
+		meshCentroid = meshCentroid * (1.0f / meshArea);
+
+	std::vector<float> potential(numClusters);
+	std::vector<size_t> sorted(numClusters);
+	for (size_t c = 0; c < numClusters; ++c)
+	{
+		float length = clusterNormals[c].Length();
+		potential[c] = length > 0.0f ? (centroids[c] - meshCentroid).Dot(clusterNormals[c]) / length : 0.0f;
+		sorted[c] = c;
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) { return potential[a] > potential[b]; });
+
+	std::vector<unsigned int> reordered;
+	reordered.reserve(indices.size());
+	for (size_t i = 0; i < numClusters; ++i)
+		reordered.insert(reordered.end(), order.begin() + clusters[sorted[i]] * 3, order.begin() + clusters[sorted[i] + 1] * 3);
+
+	// Vertices in order of first use, so the vertex arrays are also read mostly in order
+	indices.swap(reordered);
+	CompactVertices(indices, vertices, normals, uvs);
+	BuildMeshlets();
+
+	for (size_t i = 0; i < lods.size(); ++i)
+		lods[i]->OptimizeTriangleOrder(cacheSize);
+}
+
+// Simplification (Garland-Heckbert quadric error metric): edges are collapsed into one of their vertices, so the
+// simplified mesh only uses vertices (and uvs, normals) of the original. Every position keeps the quadric of the
+// planes of its triangles, its error at a point is the area weighted mean squared distance to those planes.
+struct sQuadric
+{
+	double a00 = 0, a11 = 0, a22 = 0, a01 = 0, a02 = 0, a12 = 0; // Symmetric 3x3 part
+	double b0 = 0, b1 = 0, b2 = 0, c = 0;
+	double w = 0;                                                // Sum of the weights
+
+	// Plane dot(n, p) + d = 0 with n unit length
+	void AddPlane(const Vector3& n, float d, double weight)
+	{
+		a00 += weight * n.x * n.x; a11 += weight * n.y * n.y; a22 += weight * n.z * n.z;
+		a01 += weight * n.x * n.y; a02 += weight * n.x * n.z; a12 += weight * n.y * n.z;
+		b0 += weight * n.x * d; b1 += weight * n.y * d; b2 += weight * n.z * d;
+		c += weight * d * d;
+		w += weight;
+	}
+
+	void Add(const sQuadric& q)
+	{
+		a00 += q.a00; a11 += q.a11; a22 += q.a22; a01 += q.a01; a02 += q.a02; a12 += q.a12;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2; c += q.c; w += q.w;
+	}
+
+	double Error(const Vector3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+		         + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+		return w > 0.0 ? std::max(e, 0.0) / w : 0.0;
+	}
+};
+
+// What a vertex can collapse into. Vertices are split where the uvs or normals change (seams), so a position
+// can have several vertices: those are its wedges.
+enum { VERTEX_MANIFOLD, VERTEX_BORDER, VERTEX_SEAM, VERTEX_LOCKED };
+
+// Keep collapsing edges of the triangles in indices, every time they are down to the next of targetCounts (from
+// more to less) a copy goes to levels with the error of the worst collapse so far as a distance (square root of
+// the quadric error). When nothing else can collapse the last level is what is left and it stops there.
+static void SimplifyIndices(const std::vector<Vector3>& vertices, std::vector<unsigned int> indices, const std::vector<size_t>& targetCounts,
+                            std::vector<std::vector<unsigned int> >& levels, std::vector<float>& errors)
+{
+	const unsigned int NO_EDGE = (unsigned int)-1, MANY_EDGES = (unsigned int)-2;
+	const float BORDER_WEIGHT = 10.0f; // Borders and seams only move along themselves
+	size_t numVertices = vertices.size();
+
+	// Vertices with the same position: remap points to the first one and wedge links them in a ring
+	std::vector<unsigned int> sorted(numVertices), remap(numVertices), wedge(numVertices);
+	for (size_t v = 0; v < numVertices; ++v)
+		sorted[v] = (unsigned int)v;
+	std::sort(sorted.begin(), sorted.end(), [&](unsigned int a, unsigned int b)
+	{
+		const Vector3& pa = vertices[a];
+		const Vector3& pb = vertices[b];
+		return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z != pb.z ? pa.z < pb.z : a < b;
+	});
+	for (size_t i = 0; i < numVertices;)
+	{
+		size_t j = i + 1;
+		while (j < numVertices && vertices[sorted[j]].x == vertices[sorted[i]].x && vertices[sorted[j]].y == vertices[sorted[i]].y && vertices[sorted[j]].z == vertices[sorted[i]].z)
+			j++;
+		for (size_t k = i; k < j; ++k)
+		{
+			remap[sorted[k]] = sorted[i];
+			wedge[sorted[k]] = sorted[k + 1 < j ? k + 1 : i];
+		}
+		i = j;
+	}
+
+	// Open edges: a triangle edge a->b without the opposite b->a. At a border the position has no triangles on
+	// the other side, at a seam they are there but use other wedges.
+	std::vector<unsigned long long> edges(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		unsigned int a = indices[i], b = indices[i % 3 == 2 ? i - 2 : i + 1];
+		edges[i] = (unsigned long long)a << 32 | b;
+	}
+	std::sort(edges.begin(), edges.end());
+	std::vector<unsigned int> openOut(numVertices, NO_EDGE), openIn(numVertices, NO_EDGE);
+	for (size_t i = 0; i < edges.size(); ++i)
+	{
+		unsigned int a = (unsigned int)(edges[i] >> 32), b = (unsigned int)edges[i];
+		if (std::binary_search(edges.begin(), edges.end(), (unsigned long long)b << 32 | a))
+			continue;
+		openOut[a] = openOut[a] == NO_EDGE ? b : MANY_EDGES;
+		openIn[b] = openIn[b] == NO_EDGE ? a : MANY_EDGES;
+	}
+
+	// Kinds: one wedge without open edges is free to move, one wedge with one border through it is a border, two
+	// wedges split by one seam are a seam (their open edges go to the same positions in opposite directions).
+	// Everything else (corners, several seams, non manifold) stays.
+	std::vector<unsigned char> kind(numVertices, VERTEX_LOCKED);
+	for (size_t v = 0; v < numVertices; ++v)
+	{
+		if (remap[v] != v)
+			continue;
+		unsigned int w = wedge[v];
+		unsigned char k = VERTEX_LOCKED;
+		bool oneBorder = openOut[v] < MANY_EDGES && openIn[v] < MANY_EDGES;
+		if (w == v)
+		{
+			if (openOut[v] == NO_EDGE && openIn[v] == NO_EDGE)
+				k = VERTEX_MANIFOLD;
+			else if (oneBorder)
+				k = VERTEX_BORDER;
+		}
+		else if (wedge[w] == v && oneBorder && openOut[w] < MANY_EDGES && openIn[w] < MANY_EDGES &&
+		         remap[openOut[v]] == remap[openIn[w]] && remap[openIn[v]] == remap[openOut[w]])
+			k = VERTEX_SEAM;
+
+		kind[v] = k;
+		for (unsigned int u = wedge[v]; u != v; u = wedge[u])
+			kind[u] = k;
+	}
+
+	// Quadrics by position: the planes of the triangles (weighted by area), plus planes through the open
+	// edges perpendicular to their triangle so the borders and seams keep their shape
+	std::vector<sQuadric> quadrics(numVertices);
+	for (size_t i = 0; i < indices.size(); i += 3)
+	{
+		const Vector3& p0 = vertices[indices[i]];
+		Vector3 normal = (vertices[indices[i + 1]] - p0).Cross(vertices[indices[i + 2]] - p0);
+		float length = normal.Length();
+		if (length == 0.0f)
+			continue;
+		normal = normal * (1.0f / length);
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+			quadrics[remap[a]].AddPlane(normal, -normal.Dot(p0), length * 0.5f);
+			if (std::binary_search(edges.begin(), edges.end(), (unsigned long long)b << 32 | a))
+				continue; // Not open
+
+			Vector3 edge = vertices[b] - vertices[a];
+			Vector3 side = edge.Cross(normal);
+			float sideLength = side.Length();
+			if (sideLength == 0.0f)
+				continue;
+			side = side * (1.0f / sideLength);
+			double weight = BORDER_WEIGHT * edge.Dot(edge);
+			quadrics[remap[a]].AddPlane(side, -side.Dot(vertices[a]), weight);
+			quadrics[remap[b]].AddPlane(side, -side.Dot(vertices[a]), weight);
+		}
+	}
+
+	// Can v0 go into v1: borders and seams only along their open edges, so they don't leave holes
+	auto canCollapse = [&](unsigned int v0, unsigned int v1)
+	{
+		if (kind[v0] == VERTEX_MANIFOLD)
+			return true;
+		if (kind[v0] == VERTEX_LOCKED)
+			return false;
+		return openOut[v0] == v1 || openIn[v0] == v1;
+	};
+
+	struct sCollapse
+	{
+		unsigned int v0, v1; // v0 (and its wedges) go into v1
+		double error;
+	};
+	std::vector<sCollapse> collapses;
+	std::vector<unsigned int> collapseTo(numVertices), offsets, adjacency;
+	std::vector<unsigned char> locked(numVertices);
+	for (size_t v = 0; v < numVertices; ++v)
+		collapseTo[v] = (unsigned int)v;
+	double maxError = 0.0;
+	size_t level = 0;
+	auto addLevel = [&]()
+	{
+		levels.push_back(indices);
+		errors.push_back((float)sqrt(maxError));
+		level++;
+	};
+
+	// Passes: the cheapest collapses first, each one locks the positions whose triangles it changes so the
+	// rest of the pass still sees the real triangles. Then the indices are rewritten and the next pass starts.
+	while (level < targetCounts.size())
+	{
+		size_t targetCount = targetCounts[level];
+		if (indices.size() <= targetCount)
+		{
+			addLevel();
+			continue;
+		}
+
+		collapses.clear();
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			unsigned int a = indices[i], b = indices[i % 3 == 2 ? i - 2 : i + 1];
+			if (remap[a] == remap[b])
+				continue;
+			sCollapse c = { a, b, -1.0 };
+			if (canCollapse(a, b))
+				c.error = quadrics[remap[a]].Error(vertices[b]);
+			if (canCollapse(b, a))
+			{
+				double error = quadrics[remap[b]].Error(vertices[a]);
+				if (c.error < 0.0 || error < c.error)
+					c = { b, a, error };
+			}
+			if (c.error >= 0.0)
+				collapses.push_back(c);
+		}
+		if (collapses.empty())
+		{
+			addLevel();
+			break;
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.error < b.error; });
+
+		// Triangles around every position
+		offsets.assign(numVertices + 1, 0);
+		for (size_t i = 0; i < indices.size(); ++i)
+			offsets[remap[indices[i]] + 1]++;
+		for (size_t v = 0; v < numVertices; ++v)
+			offsets[v + 1] += offsets[v];
+		adjacency.resize(indices.size());
+		for (size_t i = 0; i < indices.size(); ++i)
+			adjacency[offsets[remap[indices[i]]]++] = (unsigned int)(i / 3);
+		for (size_t v = numVertices; v > 0; --v)
+			offsets[v] = offsets[v - 1];
+		offsets[0] = 0;
+
+		// Around 2 triangles go with every collapse. The locks leave many of the cheap collapses for the next
+		// pass, so the pass stops before the expensive ones instead of reaching the goal with them.
+		size_t goal = (indices.size() - targetCount) / 3, removed = 0;
+		double passLimit = collapses[std::min(goal, collapses.size() - 1)].error * 1.5;
+		std::fill(locked.begin(), locked.end(), 0);
+		for (size_t i = 0; i < collapses.size() && removed < goal; ++i)
+		{
+			const sCollapse& c = collapses[i];
+			if (c.error > passLimit)
+				break;
+			unsigned int p0 = remap[c.v0], p1 = remap[c.v1];
+			if (locked[p0] || locked[p1])
+				continue;
+
+			// A seam moves its other wedge along the other side of the same seam
+			unsigned int w0 = wedge[c.v0], w1 = NO_EDGE;
+			if (kind[c.v0] == VERTEX_SEAM)
+			{
+				w1 = openOut[c.v0] == c.v1 ? openIn[w0] : openOut[w0];
+				if (w1 >= MANY_EDGES || remap[w1] != p1)
+					continue;
+			}
+
+			// Don't flip any triangle that stays (the ones with p0 and p1 disappear)
+			const Vector3& target = vertices[c.v1];
+			bool flips = false;
+			for (unsigned int j = offsets[p0]; j < offsets[p0 + 1] && !flips; ++j)
+			{
+				const unsigned int* t = &indices[adjacency[j] * 3];
+				if (remap[t[0]] == p1 || remap[t[1]] == p1 || remap[t[2]] == p1)
+					continue;
+				const Vector3& a = vertices[t[0]];
+				const Vector3& b = vertices[t[1]];
+				const Vector3& d = vertices[t[2]];
+				Vector3 before = (b - a).Cross(d - a);
+				const Vector3& na = remap[t[0]] == p0 ? target : a;
+				const Vector3& nb = remap[t[1]] == p0 ? target : b;
+				const Vector3& nd = remap[t[2]] == p0 ? target : d;
+				Vector3 after = (nb - na).Cross(nd - na);
+				flips = before.Dot(after) <= 0.0f;
+			}
+			if (flips)
+				continue;
+
+			collapseTo[c.v0] = c.v1;
+			if (w1 != NO_EDGE)
+				collapseTo[w0] = w1;
+			quadrics[p1].Add(quadrics[p0]);
+			maxError = std::max(maxError, c.error);
+
+			for (unsigned int j = offsets[p0]; j < offsets[p0 + 1]; ++j)
+			{
+				const unsigned int* t = &indices[adjacency[j] * 3];
+				locked[remap[t[0]]] = locked[remap[t[1]]] = locked[remap[t[2]]] = 1;
+				removed += remap[t[0]] == p1 || remap[t[1]] == p1 || remap[t[2]] == p1;
+			}
+			locked[p1] = 1;
+		}
+		if (removed == 0)
+		{
+			addLevel();
+			break;
+		}
 
-		if (tokens.empty()) continue;
+		// Move the indices of the collapsed vertices and drop the triangles that lost their area
+		size_t count = 0;
+		for (size_t i = 0; i < indices.size(); i += 3)
+		{
+			unsigned int a = collapseTo[indices[i]], b = collapseTo[indices[i + 1]], d = collapseTo[indices[i + 2]];
+			if (remap[a] == remap[b] || remap[a] == remap[d] || remap[b] == remap[d])
+				continue;
+			indices[count++] = a;
+			indices[count++] = b;
+			indices[count++] = d;
+		}
+		indices.resize(count);
 
-		if (tokens[0] == "v" && tokens.size() == 4)
+		// The open edges that ended in a collapsed vertex end in its target now
+		for (size_t v = 0; v < numVertices; ++v)
 		{
-			Vector3 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()), std::stof(tokens[3].c_str()));
-			indexed_positions.push_back(v);
+			if (openOut[v] < MANY_EDGES)
+				openOut[v] = collapseTo[openOut[v]];
+			if (openIn[v] < MANY_EDGES)
+				openIn[v] = collapseTo[openIn[v]];
 		}
-		else if (tokens[0] == "vt" && (tokens.size() == 4 || tokens.size() == 3))
+		for (size_t v = 0; v < numVertices; ++v)
+			collapseTo[v] = (unsigned int)v;
+	}
+}
+
+void Mesh::BuildLODs(int maxLevels, float ratio)
+{
+	ClearLODs();
+	if (indices.size() < 3)
+		return;
+
+	// Coarser than this the levels are not worth their memory
+	const size_t MIN_LOD_TRIANGLES = 64;
+
+	std::vector<size_t> targets;
+	size_t target = indices.size() / 3;
+	for (int level = 1; level <= maxLevels; ++level)
+	{
+		target = (size_t)(target * ratio);
+		if (target < MIN_LOD_TRIANGLES)
+			break;
+		targets.push_back(target * 3);
+	}
+
+	// All the levels in one run, each one keeps simplifying the previous with the quadrics of the original
+	std::vector<std::vector<unsigned int> > levels;
+	std::vector<float> errors;
+	SimplifyIndices(vertices, indices, targets, levels, errors);
+
+	for (size_t i = 0; i < levels.size(); ++i)
+	{
+		size_t previous = lods.empty() ? indices.size() : lods.back()->indices.size();
+		if (levels[i].size() > previous * 3 / 4)
+			break;
+
+		Mesh* lod = new Mesh();
+		lod->vertices = vertices;
+		lod->normals = normals;
+		lod->uvs = uvs;
+		lod->indices.swap(levels[i]);
+		CompactVertices(lod->indices, lod->vertices, lod->normals, lod->uvs);
+		lod->lod_error = errors[i];
+		lod->UpdateBounds();
+		lod->BuildMeshlets();
+		lods.push_back(lod);
+	}
+}
+
+// OBJ parsing: everything is read in place from the file buffer, no line copies, strings or allocations per line
+static inline const char* SkipSpaces(const char* p)
+{
+	while (*p == ' ' || *p == '\t')
+		++p;
+	return p;
+}
+
+static inline const char* NextLine(const char* p)
+{
+	const char* end = strchr(p, '\n');
+	return end ? end + 1 : p + strlen(p);
+}
+
+// Decimal float. With up to 15 significant digits and |exponent| <= 22 (what exporters write) the digits
+// and the power of ten are exact doubles, so one division rounds like strtof. Anything else uses strtof.
+static const char* ParseFloat(const char* p, float& value)
+{
+	static const double powers[23] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char* start = p;
+	bool negative = *p == '-';
+	if (*p == '-' || *p == '+')
+		++p;
+
+	unsigned long long digits = 0;
+	int numDigits = 0, exponent = 0;
+	bool any = false;
+	for (; *p >= '0' && *p <= '9'; ++p, any = true)
+	{
+		if (digits || *p != '0')
+			numDigits++;
+		digits = digits * 10 + (*p - '0');
+	}
+	if (*p == '.')
+		for (++p; *p >= '0' && *p <= '9'; ++p, any = true)
 		{
-			Vector2 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()));
-			indexed_uvs.push_back(v);
+			if (digits || *p != '0')
+				numDigits++;
+			digits = digits * 10 + (*p - '0');
+			exponent--;
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+	if (any && (*p == 'e' || *p == 'E'))
+	{
+		const char* e = p + 1;
+		bool negativeExp = *e == '-';
+		if (*e == '-' || *e == '+')
+			++e;
+		int exp = 0;
+		bool expDigits = false;
+		for (; *e >= '0' && *e <= '9' && exp < 10000; ++e, expDigits = true)
+			exp = exp * 10 + (*e - '0');
+		if (expDigits)
 		{
-			Vector3 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()), std::stof(tokens[3].c_str()));
-			indexed_normals.push_back(v);
+			exponent += negativeExp ? -exp : exp;
+			p = e;
 		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
+	}
+
+	if (!any && (*start == '\n' || *start == '\r' || *start == 0)) // Missing value, strtof would go on to the next line
+	{
+		value = 0.0f;
+		return start;
+	}
+	if (!any || numDigits > 15 || exponent < -22 || exponent > 22)
+	{
+		char* end;
+		value = strtof(start, &end);
+		return end;
+	}
+
+	double d = exponent < 0 ? (double)digits / powers[-exponent] : (double)digits * powers[exponent];
+	value = (float)(negative ? -d : d);
+	return p;
+}
+
+// OBJ index (1 based, negative counts back from the last element read), 0 if there is none
+static const char* ParseIndex(const char* p, size_t count, unsigned int& index)
+{
+	bool negative = *p == '-';
+	if (negative)
+		++p;
+	unsigned int value = 0;
+	for (; *p >= '0' && *p <= '9'; ++p)
+		value = value * 10 + (*p - '0');
+	index = negative ? (value <= count ? (unsigned int)(count - value + 1) : 0) : value;
+	return p;
+}
+
+// Position, uv and normal indices of a face corner (0 if the file has none), unique vertices are keyed by them.
+// Indices that point past the elements read so far keep their value (so the key doesn't change) plus this bit.
+static const unsigned int OBJ_BROKEN_INDEX = 0x80000000u;
+
+struct sObjCorner
+{
+	unsigned int p, t, n;
+	bool operator==(const sObjCorner& o) const { return p == o.p && t == o.t && n == o.n; }
+};
+
+// Piece of the file parsed by one thread, it starts and ends at line boundaries. The elements go straight
+// to the shared arrays at the offset of the chunk, the face corners to its own buffers (merged in file order).
+struct sObjChunk
+{
+	const char* begin;
+	const char* end;
+	size_t num_positions = 0, num_uvs = 0, num_normals = 0, num_corners = 0; // Elements in this chunk
+	size_t first_position = 0, first_uv = 0, first_normal = 0;               // Elements in the chunks before
+
+	std::vector<sObjCorner> corners;   // 3 per triangle
+	std::vector<sObjCorner> unique;    // Different corners of the chunk, in the order they are first used
+	std::vector<unsigned int> indices; // Corner -> position in unique
+	size_t first_unique = 0, first_index = 0;
+};
+
+// Corners shared by several faces become one vertex. Open addressing table with at least twice the slots
+// of the corners, keys are the unique corners found so far (kept in the order they are first used).
+static void IndexOBJCorners(const std::vector<sObjCorner>& corners, std::vector<sObjCorner>& unique, std::vector<unsigned int>& indices)
+{
+	size_t table_size = 16;
+	while (table_size < 2 * corners.size())
+		table_size *= 2;
+	std::vector<unsigned int> table(table_size, (unsigned int)-1);
+	unique.clear();
+	unique.reserve(corners.size() / 4);
+	indices.resize(corners.size());
+
+	for (size_t i = 0; i < corners.size(); ++i)
+	{
+		const sObjCorner& corner = corners[i];
+		size_t slot = ((size_t)corner.p * 73856093u ^ (size_t)corner.t * 19349663u ^ (size_t)corner.n * 83492791u) & (table_size - 1);
+		while (table[slot] != (unsigned int)-1 && !(unique[table[slot]] == corner))
+			slot = (slot + 1) & (table_size - 1);
+		if (table[slot] == (unsigned int)-1)
 		{
-			Vector3 v1, v2, v3;
-			v1 = parseVector3(tokens[1].c_str(), '/');
+			table[slot] = (unsigned int)unique.size();
+			unique.push_back(corner);
+		}
+		indices[i] = table[slot];
+	}
+}
 
-			for (size_t iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
+// First pass: count the elements of the chunk so every array is allocated once
+static void CountOBJChunk(sObjChunk& chunk)
+{
+	for (const char* pos = chunk.begin; pos < chunk.end; pos = NextLine(pos))
+	{
+		pos = SkipSpaces(pos);
+		if (pos[0] == 'v')
+		{
+			if (pos[1] == ' ' || pos[1] == '\t') chunk.num_positions++;
+			else if (pos[1] == 't') chunk.num_uvs++;
+			else if (pos[1] == 'n') chunk.num_normals++;
+		}
+		else if (pos[0] == 'f' && (pos[1] == ' ' || pos[1] == '\t'))
+		{
+			// Polygons are split in a fan, so n corners give 3 * (n - 2) indices
+			int corners = 0;
+			for (const char* c = SkipSpaces(pos + 1); *c && *c != '\n' && *c != '\r'; c = SkipSpaces(c))
 			{
-				v2 = parseVector3(tokens[iPoly].c_str(), '/');
-				v3 = parseVector3(tokens[iPoly + 1].c_str(), '/');
+				corners++;
+				while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r')
+					++c;
+			}
+			if (corners >= 3)
+				chunk.num_corners += 3 * (corners - 2);
+		}
+	}
+}
 
-				vertices.push_back(indexed_positions[(unsigned int)(v1.x) - 1]);
-				vertices.push_back(indexed_positions[(unsigned int)(v2.x) - 1]);
-				vertices.push_back(indexed_positions[(unsigned int)(v3.x) - 1]);
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
+// Second pass: parse. Negative and out of range indices are resolved with the elements read before this line
+// in the whole file (offset of the chunk + read in the chunk), so any split gives the same corners.
+static void ParseOBJChunk(sObjChunk& chunk, Vector3* positions, Vector2* uvs, Vector3* normals)
+{
+	size_t num_positions = chunk.first_position, num_uvs = chunk.first_uv, num_normals = chunk.first_normal;
+	chunk.corners.reserve(chunk.num_corners);
 
-				if (indexed_uvs.size() > 0)
+	auto parseIndex = [](const char* p, size_t count, unsigned int& index)
+	{
+		p = ParseIndex(p, count, index);
+		if (index > count)
+			index |= OBJ_BROKEN_INDEX;
+		return p;
+	};
+
+	for (const char* pos = chunk.begin; pos < chunk.end; pos = NextLine(pos))
+	{
+		pos = SkipSpaces(pos);
+		if (pos[0] == 'v' && (pos[1] == ' ' || pos[1] == '\t'))
+		{
+			Vector3& v = positions[num_positions++];
+			pos = ParseFloat(SkipSpaces(pos + 1), v.x);
+			pos = ParseFloat(SkipSpaces(pos), v.y);
+			pos = ParseFloat(SkipSpaces(pos), v.z);
+		}
+		else if (pos[0] == 'v' && pos[1] == 't')
+		{
+			Vector2& v = uvs[num_uvs++];
+			pos = ParseFloat(SkipSpaces(pos + 2), v.x);
+			pos = ParseFloat(SkipSpaces(pos), v.y);
+		}
+		else if (pos[0] == 'v' && pos[1] == 'n')
+		{
+			Vector3& v = normals[num_normals++];
+			pos = ParseFloat(SkipSpaces(pos + 2), v.x);
+			pos = ParseFloat(SkipSpaces(pos), v.y);
+			pos = ParseFloat(SkipSpaces(pos), v.z);
+		}
+		else if (pos[0] == 'f' && (pos[1] == ' ' || pos[1] == '\t'))
+		{
+			// Corners are p, p/t, p//n or p/t/n. The polygon is drawn as a fan around its first corner.
+			sObjCorner first, prev, corner;
+			int count = 0;
+			pos = SkipSpaces(pos + 1);
+			while (*pos == '-' || (*pos >= '0' && *pos <= '9'))
+			{
+				corner.t = corner.n = 0;
+				pos = parseIndex(pos, num_positions, corner.p);
+				if (corner.p == 0)
+					corner.p = OBJ_BROKEN_INDEX;
+				if (*pos == '/')
 				{
-					uvs.push_back(indexed_uvs[(unsigned int)(v1.y) - 1]);
-					uvs.push_back(indexed_uvs[(unsigned int)(v2.y) - 1]);
-					uvs.push_back(indexed_uvs[(unsigned int)(v3.y) - 1]);
+					if (pos[1] != '/')
+						pos = parseIndex(pos + 1, num_uvs, corner.t);
+					else
+						++pos;
+					if (*pos == '/')
+						pos = parseIndex(pos + 1, num_normals, corner.n);
 				}
+				if (num_uvs == 0) corner.t = 0;
+				if (num_normals == 0) corner.n = 0;
 
-				if (indexed_normals.size() > 0)
+				if (count == 0)
+					first = corner;
+				else if (count >= 2)
 				{
-					normals.push_back(indexed_normals[(unsigned int)(v1.z) - 1]);
-					normals.push_back(indexed_normals[(unsigned int)(v2.z) - 1]);
-					normals.push_back(indexed_normals[(unsigned int)(v3.z) - 1]);
+					chunk.corners.push_back(first);
+					chunk.corners.push_back(prev);
+					chunk.corners.push_back(corner);
 				}
+				prev = corner;
+				count++;
+				pos = SkipSpaces(pos);
 			}
 		}
 	}
+}
+
+// Binary mesh file (.mbin): one block for the mesh and one for each of its levels of detail. A block is this
+// header, then the vertices, uvs, normals, indices and the 3 meshlet arrays exactly as they are in the Mesh
+// arrays, each one starting at a multiple of 16 bytes.
+static const unsigned int MESH_FILE_VERSION = 5; // Change it when the layout, the OBJ parsing or the meshlet build changes
+static const int MESH_FILE_ARRAYS = 7;
+
+struct sMeshFileHeader
+{
+	char magic[4];                   // "MBIN"
+	unsigned int version;            // MESH_FILE_VERSION
+	unsigned long long source_size;  // Size and modification time of the OBJ it comes from,
+	long long source_time;           // if they change the file is stale
+	unsigned int num_vertices, num_uvs, num_normals, num_indices;
+	Vector3 aabb_min, aabb_max;
+	Vector3 sphere_center;
+	float sphere_radius;
+	unsigned int num_lods;           // Blocks of levels of detail after this one (0 in those blocks)
+	float lod_error;
+	unsigned int flags;              // MESH_FILE_* the mesh was processed with, the same in every block
+	unsigned int num_meshlets, num_meshlet_vertices, num_meshlet_triangles;
+};
+
+// Processing done by LoadOBJ before writing the file, a file with other flags is stale
+static const unsigned int MESH_FILE_OPTIMIZED = 1;
+static const unsigned int MESH_FILE_LODS = 2;
+
+static_assert(sizeof(Vector3) == 12 && sizeof(Vector2) == 8, "The mesh file stores the vectors as raw floats");
+static_assert(sizeof(sMeshlet) == 60, "The mesh file stores the meshlets as raw structs");
+static_assert(sizeof(sMeshFileHeader) == 104, "The mesh file header has no padding");
+
+// Bytes of each array of a block
+static void GetMeshFileSizes(const sMeshFileHeader& header, size_t sizes[MESH_FILE_ARRAYS])
+{
+	sizes[0] = (size_t)header.num_vertices * sizeof(Vector3);
+	sizes[1] = (size_t)header.num_uvs * sizeof(Vector2);
+	sizes[2] = (size_t)header.num_normals * sizeof(Vector3);
+	sizes[3] = (size_t)header.num_indices * sizeof(unsigned int);
+	sizes[4] = (size_t)header.num_meshlets * sizeof(sMeshlet);
+	sizes[5] = (size_t)header.num_meshlet_vertices * sizeof(unsigned int);
+	sizes[6] = (size_t)header.num_meshlet_triangles * 3;
+}
+
+// Offsets of the arrays from the start of the block, returns the size of the whole block
+static size_t GetMeshFileLayout(const sMeshFileHeader& header, size_t offsets[MESH_FILE_ARRAYS])
+{
+	size_t sizes[MESH_FILE_ARRAYS];
+	GetMeshFileSizes(header, sizes);
+	size_t offset = sizeof(sMeshFileHeader);
+	for (int i = 0; i < MESH_FILE_ARRAYS; ++i)
+	{
+		offsets[i] = (offset + 15) & ~(size_t)15;
+		offset = offsets[i] + sizes[i];
+	}
+	return (offset + 15) & ~(size_t)15;
+}
+
+// Whole file mapped read only, data is NULL if it can't be mapped. The pages are read on first access.
+struct sMappedFile
+{
+	const char* data = NULL;
+	size_t size = 0;
+
+#ifdef WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+
+	sMappedFile(const char* filename)
+	{
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		LARGE_INTEGER file_size;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+			return;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data)
+			size = (size_t)file_size.QuadPart;
+	}
+	~sMappedFile()
+	{
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	}
+#else
+	sMappedFile(const char* filename)
+	{
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat stbuffer;
+		if (fstat(fd, &stbuffer) == 0 && stbuffer.st_size > 0)
+		{
+			void* p = mmap(NULL, (size_t)stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				data = (const char*)p;
+				size = (size_t)stbuffer.st_size;
+			}
+		}
+		close(fd); // The mapping keeps the file alive
+	}
+	~sMappedFile()
+	{
+		if (data) munmap((void*)data, size);
+	}
+#endif
+};
+
+size_t Mesh::ReadBinaryBlock(const char* data, size_t size, unsigned long long sourceSize, long long sourceTime, unsigned int flags, unsigned int& numLODs)
+{
+	if (size < sizeof(sMeshFileHeader))
+		return 0;
+
+	sMeshFileHeader header;
+	memcpy(&header, data, sizeof(header));
+	size_t offsets[MESH_FILE_ARRAYS];
+	size_t block_size = GetMeshFileLayout(header, offsets);
+	if (memcmp(header.magic, "MBIN", 4) != 0 || header.version != MESH_FILE_VERSION ||
+		header.source_size != sourceSize || header.source_time != sourceTime || header.flags != flags || block_size > size)
+		return 0;
+
+	// uvs and normals are parallel to the vertices or not there at all
+	if ((header.num_uvs && header.num_uvs != header.num_vertices) || (header.num_normals && header.num_normals != header.num_vertices))
+		return 0;
+
+	// A broken file must not give indices out of the arrays: every triangle and every meshlet is checked
+	// before anything is copied (one pass over data that is read anyway)
+	const unsigned int* file_indices = (const unsigned int*)(data + offsets[3]);
+	const sMeshlet* file_meshlets = (const sMeshlet*)(data + offsets[4]);
+	const unsigned int* file_meshlet_vertices = (const unsigned int*)(data + offsets[5]);
+	const unsigned char* file_meshlet_triangles = (const unsigned char*)(data + offsets[6]);
+	if (header.num_indices % 3 != 0)
+		return 0;
+	for (unsigned int i = 0; i < header.num_indices; ++i)
+		if (file_indices[i] >= header.num_vertices)
+			return 0;
+	for (unsigned int i = 0; i < header.num_meshlet_vertices; ++i)
+		if (file_meshlet_vertices[i] >= header.num_vertices)
+			return 0;
+	for (unsigned int i = 0; i < header.num_meshlets; ++i)
+	{
+		const sMeshlet& meshlet = file_meshlets[i];
+		if (meshlet.num_vertices > MESHLET_MAX_VERTICES || meshlet.num_triangles > MESHLET_MAX_TRIANGLES ||
+			(unsigned long long)meshlet.first_vertex + meshlet.num_vertices > header.num_meshlet_vertices ||
+			(unsigned long long)meshlet.first_triangle + meshlet.num_triangles > header.num_meshlet_triangles)
+			return 0;
+		const unsigned char* triangle = file_meshlet_triangles + (size_t)meshlet.first_triangle * 3;
+		for (unsigned int k = 0; k < meshlet.num_triangles * 3; ++k)
+			if (triangle[k] >= meshlet.num_vertices)
+				return 0;
+	}
+
+	// The arrays are already in memory layout, one copy each into the vectors
+	const Vector3* file_vertices = (const Vector3*)(data + offsets[0]);
+	const Vector2* file_uvs = (const Vector2*)(data + offsets[1]);
+	const Vector3* file_normals = (const Vector3*)(data + offsets[2]);
+	vertices.assign(file_vertices, file_vertices + header.num_vertices);
+	uvs.assign(file_uvs, file_uvs + header.num_uvs);
+	normals.assign(file_normals, file_normals + header.num_normals);
+	indices.assign(file_indices, file_indices + header.num_indices);
+	meshlets.assign(file_meshlets, file_meshlets + header.num_meshlets);
+	meshlet_vertices.assign(file_meshlet_vertices, file_meshlet_vertices + header.num_meshlet_vertices);
+	meshlet_triangles.assign(file_meshlet_triangles, file_meshlet_triangles + (size_t)header.num_meshlet_triangles * 3);
+	aabb_min = header.aabb_min;
+	aabb_max = header.aabb_max;
+	sphere_center = header.sphere_center;
+	sphere_radius = header.sphere_radius;
+	lod_error = header.lod_error;
+	numLODs = header.num_lods;
+	return block_size;
+}
+
+bool Mesh::LoadBinary(const std::string& filename, unsigned long long sourceSize, long long sourceTime, unsigned int flags)
+{
+	sMappedFile file(filename.c_str());
+	if (!file.data)
+		return false;
+
+	unsigned int numLODs = 0, unused;
+	size_t offset = ReadBinaryBlock(file.data, file.size, sourceSize, sourceTime, flags, numLODs);
+	for (unsigned int i = 0; i < numLODs && offset > 0; ++i)
+	{
+		Mesh* lod = new Mesh();
+		lods.push_back(lod);
+		size_t block_size = lod->ReadBinaryBlock(file.data + offset, file.size - offset, sourceSize, sourceTime, flags, unused);
+		offset = block_size ? offset + block_size : 0;
+	}
+
+	// Anything missing or left over: the file is broken, back to an empty mesh so the OBJ is parsed
+	if (offset != file.size)
+	{
+		Clear();
+		return false;
+	}
+	return true;
+}
+
+bool Mesh::WriteBinaryBlock(FILE* f, unsigned long long sourceSize, long long sourceTime, unsigned int flags) const
+{
+	sMeshFileHeader header;
+	memcpy(header.magic, "MBIN", 4);
+	header.version = MESH_FILE_VERSION;
+	header.source_size = sourceSize;
+	header.source_time = sourceTime;
+	header.num_vertices = (unsigned int)vertices.size();
+	header.num_uvs = (unsigned int)uvs.size();
+	header.num_normals = (unsigned int)normals.size();
+	header.num_indices = (unsigned int)indices.size();
+	header.aabb_min = aabb_min;
+	header.aabb_max = aabb_max;
+	header.sphere_center = sphere_center;
+	header.sphere_radius = sphere_radius;
+	header.num_lods = (unsigned int)lods.size();
+	header.lod_error = lod_error;
+	header.flags = flags;
+	header.num_meshlets = (unsigned int)meshlets.size();
+	header.num_meshlet_vertices = (unsigned int)meshlet_vertices.size();
+	header.num_meshlet_triangles = (unsigned int)(meshlet_triangles.size() / 3);
+
+	size_t offsets[MESH_FILE_ARRAYS], sizes[MESH_FILE_ARRAYS];
+	size_t block_size = GetMeshFileLayout(header, offsets);
+	GetMeshFileSizes(header, sizes);
+	const void* arrays[MESH_FILE_ARRAYS] = { vertices.data(), uvs.data(), normals.data(), indices.data(),
+	                                         meshlets.data(), meshlet_vertices.data(), meshlet_triangles.data() };
+
+	static const char zeros[16] = {};
+	size_t written = fwrite(&header, sizeof(header), 1, f) * sizeof(header);
+	for (int i = 0; i <= MESH_FILE_ARRAYS; ++i)
+	{
+		size_t offset = i < MESH_FILE_ARRAYS ? offsets[i] : block_size;
+		written += fwrite(zeros, 1, offset - written, f); // Alignment padding
+		if (i < MESH_FILE_ARRAYS && sizes[i])
+			written += fwrite(arrays[i], 1, sizes[i], f);
+	}
+	return written == block_size;
+}
+
+bool Mesh::SaveBinary(const std::string& filename, unsigned long long sourceSize, long long sourceTime, unsigned int flags) const
+{
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+		return false;
+
+	bool ok = WriteBinaryBlock(f, sourceSize, sourceTime, flags);
+	for (size_t i = 0; i < lods.size() && ok; ++i)
+		ok = lods[i]->WriteBinaryBlock(f, sourceSize, sourceTime, flags);
+
+	// A half written file would be rejected by its size anyway, but don't leave it around
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+		remove(filename.c_str());
+	return ok;
+}
+
+bool Mesh::LoadOBJ(const char* filename, const sMeshLoadOptions& options)
+{
+	struct stat stbuffer;
+	std::cout << "Loading mesh: " << filename << std::endl;
+
+	std::string relPath = absResPath(filename);
+
+	FILE* f = fopen(relPath.c_str(), "rb");
+	if (f == NULL)
+	{
+		std::cerr << "File not found: " << filename << std::endl;
+		return false;
+	}
+
+	// Parsed before: map the binary copy instead. Only for empty meshes, the file has just the OBJ.
+	// Without the size and time of the OBJ the copy can't be checked, so it is not used (or written).
+	std::string binPath = relPath + ".mbin";
+	bool cached = vertices.empty() && indices.empty();
+	if (stat(relPath.c_str(), &stbuffer) != 0)
+	{
+		cached = false;
+		fseek(f, 0, SEEK_END);
+		stbuffer.st_size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+	}
+	unsigned int flags = (options.optimizeOrder ? MESH_FILE_OPTIMIZED : 0) | (options.buildLODs ? MESH_FILE_LODS : 0);
+	std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+	if (cached && LoadBinary(binPath, stbuffer.st_size, stbuffer.st_mtime, flags))
+	{
+		fclose(f);
+		float seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << "  " << vertices.size() << " vertices, " << GetNumTriangles() << " triangles, "
+		          << GetMemorySize() / 1024 << " KB, " << lods.size() << " LODs, loaded from " << binPath << " in " << seconds * 1000.0f << " ms" << std::endl;
+		return true;
+	}
+
+	size_t size = stbuffer.st_size < 0 ? 0 : (size_t)stbuffer.st_size;
+	char* data = new char[size + 1];
+	size_t read = fread(data, 1, size, f);
+	fclose(f);
+	if (read != size)
+	{
+		std::cerr << "Can't read " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+	data[size] = 0;
+	size = strlen(data); // A 0 inside the file ends it, for every chunk alike
+
+	start_time = std::chrono::high_resolution_clock::now();
+
+	// Split at line boundaries, one chunk per thread. By default small files are not worth the threads.
+	const size_t MIN_CHUNK_SIZE = 1 << 20;
+	size_t num_chunks = (size_t)options.numThreads;
+	if (options.numThreads <= 0)
+		num_chunks = std::max((size_t)1, std::min((size_t)std::thread::hardware_concurrency(), size / MIN_CHUNK_SIZE));
+
+	std::vector<sObjChunk> chunks(num_chunks);
+	const char* chunk_begin = data;
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		const char* chunk_end = data + size;
+		if (i + 1 < num_chunks)
+		{
+			chunk_end = std::max(chunk_begin, (const char*)data + size * (i + 1) / num_chunks);
+			const char* newline = (const char*)memchr(chunk_end, '\n', data + size - chunk_end);
+			chunk_end = newline ? newline + 1 : data + size;
+		}
+		chunks[i].begin = chunk_begin;
+		chunks[i].end = chunk_end;
+		chunk_begin = chunk_end;
+	}
+
+	// Chunk 0 runs on this thread, the rest on their own
+	auto forEachChunk = [&](const std::function<void(sObjChunk&)>& job)
+	{
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < num_chunks; ++i)
+			threads.push_back(std::thread(job, std::ref(chunks[i])));
+		job(chunks[0]);
+		for (size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+	};
+
+	forEachChunk(CountOBJChunk);
+
+	size_t num_positions = 0, num_uvs = 0, num_normals = 0, num_corners = 0;
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		chunks[i].first_position = num_positions;
+		chunks[i].first_uv = num_uvs;
+		chunks[i].first_normal = num_normals;
+		num_positions += chunks[i].num_positions;
+		num_uvs += chunks[i].num_uvs;
+		num_normals += chunks[i].num_normals;
+		num_corners += chunks[i].num_corners;
+	}
+	if (num_positions == 0 && num_corners > 0)
+		std::cerr << "Wrong vertex index in " << filename << std::endl;
+
+	std::vector<Vector3> indexed_positions(num_positions);
+	std::vector<Vector3> indexed_normals(num_normals);
+	std::vector<Vector2> indexed_uvs(num_uvs);
+
+	// Parse and index the corners of each chunk in parallel, the corner buffer is not needed after that
+	forEachChunk([&](sObjChunk& chunk)
+	{
+		ParseOBJChunk(chunk, indexed_positions.data(), indexed_uvs.data(), indexed_normals.data());
+		if (indexed_positions.empty()) // Faces without positions can't be drawn
+			chunk.corners.clear();
+		IndexOBJCorners(chunk.corners, chunk.unique, chunk.indices);
+		std::vector<sObjCorner>().swap(chunk.corners);
+	});
+
+	// Merge: only the unique corners of every chunk, in file order, so the vertices are numbered in the order
+	// they are first used in the file and the mesh is the same with any split. With one chunk there is nothing to merge.
+	std::vector<sObjCorner> vertex_corners; // Corners of the mesh vertices
+	std::vector<unsigned int> remap;        // Unique corner of a chunk (first_unique + i) -> vertex
+	size_t num_indices = 0;
+	if (num_chunks == 1)
+		vertex_corners.swap(chunks[0].unique);
+	else
+	{
+		std::vector<sObjCorner> chunk_corners;
+		for (size_t i = 0; i < num_chunks; ++i)
+		{
+			chunks[i].first_unique = chunk_corners.size();
+			chunk_corners.insert(chunk_corners.end(), chunks[i].unique.begin(), chunks[i].unique.end());
+		}
+		IndexOBJCorners(chunk_corners, vertex_corners, remap);
+	}
+	for (size_t i = 0; i < num_chunks; ++i)
+	{
+		chunks[i].first_index = num_indices;
+		num_indices += chunks[i].indices.size();
+	}
+
+	unsigned int first_vertex = (unsigned int)vertices.size();
+	size_t first_index = indices.size();
+	indices.resize(first_index + num_indices);
+	forEachChunk([&](sObjChunk& chunk)
+	{
+		unsigned int* out = indices.data() + first_index + chunk.first_index;
+		for (size_t i = 0; i < chunk.indices.size(); ++i)
+			out[i] = first_vertex + (remap.empty() ? chunk.indices[i] : remap[chunk.first_unique + chunk.indices[i]]);
+	});
+
+	vertices.reserve(vertices.size() + vertex_corners.size());
+	if (indexed_uvs.size() > 0) // uvs/normals stay parallel to the vertices
+		uvs.reserve(uvs.size() + vertex_corners.size());
+	if (indexed_normals.size() > 0)
+		normals.reserve(normals.size() + vertex_corners.size());
+	for (size_t i = 0; i < vertex_corners.size(); ++i)
+	{
+		const sObjCorner& corner = vertex_corners[i];
+		if (corner.p & OBJ_BROKEN_INDEX) // Broken index: use the first position
+			std::cerr << "Wrong vertex index in " << filename << std::endl;
+
+		vertices.push_back(indexed_positions[corner.p & OBJ_BROKEN_INDEX ? 0 : corner.p - 1]);
+		if (indexed_uvs.size() > 0)
+			uvs.push_back(corner.t && !(corner.t & OBJ_BROKEN_INDEX) ? indexed_uvs[corner.t - 1] : Vector2(0, 0));
+		if (indexed_normals.size() > 0)
+			normals.push_back(corner.n && !(corner.n & OBJ_BROKEN_INDEX) ? indexed_normals[corner.n - 1] : Vector3(0, 0, 0));
+	}
 
 	delete[] data;
+	UpdateBounds();
+
+	float seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start_time).count();
+	std::cout << "  " << vertices.size() << " vertices, " << GetNumTriangles() << " triangles, "
+	          << GetMemorySize() / 1024 << " KB, parsed in " << seconds * 1000.0f << " ms ("
+	          << (seconds > 0.0f ? size / (1024.0f * 1024.0f) / seconds : 0.0f) << " MB/s, "
+	          << num_chunks << (num_chunks == 1 ? " thread)" : " threads)") << std::endl;
+
+	// Levels of detail of the whole mesh, the cache keeps them so this is only paid once per OBJ
+	if (options.buildLODs)
+	{
+		start_time = std::chrono::high_resolution_clock::now();
+		BuildLODs();
+		seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << "  LODs:";
+		for (size_t i = 0; i < lods.size(); ++i)
+			std::cout << " " << lods[i]->GetNumTriangles() << " (error " << lods[i]->GetLODError() << ")";
+		std::cout << " triangles, built in " << seconds * 1000.0f << " ms" << std::endl;
+	}
+
+	// The reorder also builds the meshlets (of the levels too), so it goes before writing the cache
+	if (options.optimizeOrder)
+	{
+		float before = GetACMR();
+		OptimizeTriangleOrder();
+		std::cout << "  ACMR (16 vertex cache): " << before << " -> " << GetACMR() << std::endl;
+	}
+	else
+		BuildMeshlets();
 
+	if (cached && !SaveBinary(binPath, stbuffer.st_size, stbuffer.st_mtime, flags))
+		std::cerr << "Can't write the mesh cache " << binPath << std::endl;
 	return true;
 }
@@ -1,23 +1,90 @@
 /*
 	The Mesh contains the info about how to render a mesh and also how to parse it from a file.
+	+ Meshes loaded from OBJ are indexed: every unique position/uv/normal combination is stored once
+	  and the triangles are 3 indices each, so a vertex shared by several triangles is transformed once.
+	  The Create* shapes are not indexed (no index buffer, every 3 vertices are a triangle).
+	+ LoadOBJ keeps a binary copy of every parsed file next to it (<file>.obj.mbin) with the arrays as they
+	  are here (after the processing of sMeshLoadOptions), later loads map that file instead of parsing the
+	  text again (until the OBJ or the options change).
+	+ Indexed meshes are also split in meshlets: clusters of neighbouring triangles with up to 64 vertices and
+	  124 triangles, each one with a bounding sphere and a normal cone so it can be culled as a whole.
+	+ LoadOBJ can also build levels of detail (buildLODs): simplified copies of the mesh with half the
+	  triangles each (quadric error edge collapses, keeping the borders and the uv/normal seams). Every level
+	  keeps how far its surface moved from the original so the Entity can pick one by its size on screen.
+	+ OptimizeTriangleOrder reorders the triangles of an indexed mesh for the post-transform vertex
+	  cache (Tipsify) and for overdraw (clusters that face outwards are drawn first).
 */
 
 #pragma once
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
 #include "framework.h"
 #include "camera.h"
 #include "main/includes.h"
 
+// Cluster of neighbouring triangles of an indexed mesh, culled as a whole before transforming its vertices
+struct sMeshlet
+{
+	unsigned int first_vertex, num_vertices;      // Range of Mesh::meshlet_vertices (mesh vertex of each local vertex)
+	unsigned int first_triangle, num_triangles;   // Range of the triangles in Mesh::meshlet_triangles (3 local indices each)
+
+	Vector3 center;                               // Bounding sphere
+	float radius;
+
+	// Normal cone: seen from any point p with dot(normalize(cone_apex - p), cone_axis) >= cone_cutoff
+	// all the triangles are back faces. cone_cutoff is 2 when the normals are too spread for the test.
+	Vector3 cone_apex;
+	Vector3 cone_axis;
+	float cone_cutoff;
+};
+
+// What LoadOBJ does to a mesh after parsing it. The binary cache stores the processed mesh, so a cached
+// load is not processed again (a cache made with other options is parsed and written again)
+struct sMeshLoadOptions
+{
+	int numThreads = 0;         // Parser threads, any split gives exactly the same mesh (1 = serial, 0 = one per core, but at least 1MB of file per thread)
+	bool optimizeOrder = false; // OptimizeTriangleOrder
+	bool buildLODs = false;     // BuildLODs with the default levels, only worth it if something draws them
+};
+
 class Mesh
 {
 	std::vector<Vector3> vertices;
 	std::vector<Vector3> normals;
 	std::vector<Vector2> uvs;
+	std::vector<unsigned int> indices; // 3 per triangle, empty if the mesh is not indexed
+	Vector3 aabb_min, aabb_max;        // Bounding box of the vertices (local space)
+	Vector3 sphere_center;             // Bounding sphere, centered in the box
+	float sphere_radius = 0.0f;
+
+	std::vector<sMeshlet> meshlets;
+	std::vector<unsigned int> meshlet_vertices;    // Mesh vertices of every meshlet, one after the other
+	std::vector<unsigned char> meshlet_triangles;  // 3 local vertex indices (into its meshlet_vertices) per triangle
+
+	std::vector<Mesh*> lods; // Levels of detail 1, 2... (owned), each one a whole mesh with its own vertices
+	float lod_error = 0.0f;  // How far the surface of this level is from the original mesh (local units)
+
+	void UpdateBounds();
+
+	// Binary cache of an OBJ, the size and modification time of the OBJ tell if it is still valid
+	// The file has the mesh followed by its levels of detail, each one written and read by the Block functions
+	// flags are the options it was processed with (MESH_FILE_* in mesh.cpp)
+	bool LoadBinary(const std::string& filename, unsigned long long sourceSize, long long sourceTime, unsigned int flags);
+	bool SaveBinary(const std::string& filename, unsigned long long sourceSize, long long sourceTime, unsigned int flags) const;
+	size_t ReadBinaryBlock(const char* data, size_t size, unsigned long long sourceSize, long long sourceTime, unsigned int flags, unsigned int& numLODs);
+	bool WriteBinaryBlock(FILE* f, unsigned long long sourceSize, long long sourceTime, unsigned int flags) const;
+
+	void ClearLODs();
 
 public:
 
 	Mesh();
+	~Mesh();
+	Mesh(const Mesh&) = delete; // Owns its levels of detail
+	Mesh& operator=(const Mesh&) = delete;
 	void Clear();
 	void Render(int primitive = GL_TRIANGLES);
 
@@ -25,9 +92,47 @@ public:
 	void CreateCube(float size);
 	void CreateQuad();
 
-	bool LoadOBJ(const char* filename);
+	// The file is split in options.numThreads chunks parsed in parallel
+	bool LoadOBJ(const char* filename, const sMeshLoadOptions& options = sMeshLoadOptions());
 
 	const std::vector<Vector3>& GetVertices() { return vertices; }
 	const std::vector<Vector3>& GetNormals() { return normals; }
 	const std::vector<Vector2>& GetUVs() { return uvs; }
+	const std::vector<unsigned int>& GetIndices() { return indices; }
+
+	const Vector3& GetAABBMin() const { return aabb_min; }
+	const Vector3& GetAABBMax() const { return aabb_max; }
+	const Vector3& GetSphereCenter() const { return sphere_center; }
+	float GetSphereRadius() const { return sphere_radius; }
+
+	static const int MESHLET_MAX_VERTICES = 64;
+	static const int MESHLET_MAX_TRIANGLES = 124;
+
+	const std::vector<sMeshlet>& GetMeshlets() const { return meshlets; }
+	const std::vector<unsigned int>& GetMeshletVertices() const { return meshlet_vertices; }
+	const std::vector<unsigned char>& GetMeshletTriangles() const { return meshlet_triangles; }
+
+	// Split the triangles in meshlets in their current order (done by LoadOBJ and OptimizeTriangleOrder)
+	void BuildMeshlets();
+
+	size_t GetNumTriangles() const { return (indices.empty() ? vertices.size() : indices.size()) / 3; }
+	size_t GetMemorySize() const; // Bytes of the vertex and index arrays
+
+	// Average cache miss ratio: vertices transformed per triangle with a FIFO post-transform
+	// cache of cacheSize vertices (0.5 is the best possible, 3 means no reuse at all)
+	float GetACMR(int cacheSize = 16) const;
+
+	// Reorder the triangles for a cache of cacheSize vertices and for less overdraw, then renumber the
+	// vertices in the order they are first used. Only for indexed meshes, the levels of detail are reordered too.
+	// LoadOBJ does it with optimizeOrder (and keeps the result in the cache).
+	void OptimizeTriangleOrder(int cacheSize = 16);
+
+	// Levels of detail of an indexed mesh (done by LoadOBJ with buildLODs): every level has ratio times the triangles of the
+	// previous one, up to maxLevels or until the simplifier can't remove enough (the rest is borders and seams)
+	void BuildLODs(int maxLevels = 4, float ratio = 0.5f);
+
+	// Level 0 is the mesh itself, levels past the last one give the last one
+	int GetNumLODs() const { return 1 + (int)lods.size(); }
+	Mesh* GetLOD(int level) { return level <= 0 || lods.empty() ? this : lods[std::min(level, (int)lods.size()) - 1]; }
+	float GetLODError() const { return lod_error; }
 };
@@ -0,0 +1,171 @@
+#include "rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+Rasterizer::Rasterizer()
+{
+	next_tile = 0;
+
+	// One worker per extra core, the main thread also rasterizes tiles during Flush
+	unsigned int cores = std::thread::hardware_concurrency();
+	int num_workers = cores > 1 ? (int)cores - 1 : 0;
+
+	for (int i = 0; i < num_workers; ++i)
+		workers.push_back(std::thread(&Rasterizer::WorkerLoop, this));
+}
+
+Rasterizer::~Rasterizer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	start_cv.notify_all();
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void Rasterizer::Begin(Image* framebuffer, FloatImage* zbuffer)
+{
+	this->framebuffer = framebuffer;
+	this->zbuffer = zbuffer;
+
+	tiles_x = ((int)framebuffer->width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = ((int)framebuffer->height + TILE_SIZE - 1) / TILE_SIZE;
+
+	// Keep the allocations from the previous frame, just empty the lists
+	triangles.clear();
+	bins.resize(tiles_x * tiles_y);
+	for (size_t i = 0; i < bins.size(); ++i)
+		bins[i].clear();
+
+	if (useVisibilityBuffer)
+		ids.resize(framebuffer->width * framebuffer->height);
+}
+
+void Rasterizer::AddTriangle(const sTriangleInfo& t)
+{
+	if (!framebuffer)
+		return;
+
+	// Same bounding box as the one used by DrawTriangleInterpolated
+	int minX = (int)floor(std::min(t.p0.x, std::min(t.p1.x, t.p2.x)));
+	int maxX = (int)ceil (std::max(t.p0.x, std::max(t.p1.x, t.p2.x)));
+	int minY = (int)floor(std::min(t.p0.y, std::min(t.p1.y, t.p2.y)));
+	int maxY = (int)ceil (std::max(t.p0.y, std::max(t.p1.y, t.p2.y)));
+
+	if (maxX < 0 || maxY < 0 || minX >= (int)framebuffer->width || minY >= (int)framebuffer->height)
+		return;
+
+	int tx0 = std::max(minX, 0) / TILE_SIZE;
+	int ty0 = std::max(minY, 0) / TILE_SIZE;
+	int tx1 = std::min(maxX / TILE_SIZE, tiles_x - 1);
+	int ty1 = std::min(maxY / TILE_SIZE, tiles_y - 1);
+
+	unsigned int index = (unsigned int)triangles.size();
+	triangles.push_back(t);
+
+	for (int ty = ty0; ty <= ty1; ++ty)
+		for (int tx = tx0; tx <= tx1; ++tx)
+			bins[ty * tiles_x + tx].push_back(index);
+}
+
+void Rasterizer::Flush()
+{
+	stats.Clear();
+
+	if (!framebuffer || triangles.empty())
+		return;
+
+	next_tile = 0;
+
+	// Wake up the workers
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		busy_workers = (int)workers.size();
+		frame_id++;
+	}
+	start_cv.notify_all();
+
+	// The main thread works too instead of just waiting
+	RasterizeTiles();
+
+	// Wait until every worker has run out of tiles
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cv.wait(lock, [this] { return busy_workers == 0; });
+}
+
+void Rasterizer::WorkerLoop()
+{
+	unsigned int last_frame = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cv.wait(lock, [this, last_frame] { return quit || frame_id != last_frame; });
+			if (quit)
+				return;
+			last_frame = frame_id;
+		}
+
+		RasterizeTiles();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy_workers--;
+		}
+		done_cv.notify_one();
+	}
+}
+
+void Rasterizer::RasterizeTiles()
+{
+	int num_tiles = tiles_x * tiles_y;
+	sRasterStats thread_stats; // Local to the thread, merged once at the end
+
+	// Tiles are handed out one by one, so big and empty tiles balance out between threads
+	while (true)
+	{
+		int tile = next_tile.fetch_add(1);
+		if (tile >= num_tiles)
+			break;
+		RasterizeTile(tile, &thread_stats);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	stats.Add(thread_stats);
+}
+
+void Rasterizer::RasterizeTile(int tile, sRasterStats* tile_stats)
+{
+	const std::vector<unsigned int>& bin = bins[tile];
+	if (bin.empty())
+		return;
+
+	// Pixel bounds of this tile, only this thread writes inside them
+	int minX = (tile % tiles_x) * TILE_SIZE;
+	int minY = (tile / tiles_x) * TILE_SIZE;
+	int maxX = std::min(minX + TILE_SIZE, (int)framebuffer->width) - 1;
+	int maxY = std::min(minY + TILE_SIZE, (int)framebuffer->height) - 1;
+
+	if (!useVisibilityBuffer)
+	{
+		// Triangles are drawn in submission order so the result matches the serial path
+		for (size_t i = 0; i < bin.size(); ++i)
+			framebuffer->DrawTriangleInterpolated(triangles[bin[i]], zbuffer, minX, minY, maxX, maxY, tile_stats);
+		return;
+	}
+
+	// Visibility buffer: both passes run on the same tile, so no sync between threads is needed
+	unsigned int width = framebuffer->width;
+	for (int y = minY; y <= maxY; ++y)
+		std::fill(ids.begin() + y * width + minX, ids.begin() + y * width + maxX + 1, 0u);
+
+	for (size_t i = 0; i < bin.size(); ++i)
+		framebuffer->DrawTriangleVisibility(triangles[bin[i]], bin[i] + 1, zbuffer, ids.data(), minX, minY, maxX, maxY, tile_stats);
+
+	framebuffer->ShadeVisibility(triangles.data(), ids.data(), minX, minY, maxX, maxY, tile_stats);
+}
@@ -0,0 +1,69 @@
+/*
+	+ Binned multithreaded rasterizer used behind Entity::Render.
+	+ Triangles are stored for the whole frame and binned into screen tiles. On Flush a pool of
+	  worker threads rasterizes the tiles in parallel, so every thread owns the color and depth of its tile.
+	+ Optional visibility buffer: each tile first resolves depth and the id of the visible triangle,
+	  then shades every visible pixel once (no shading is wasted on pixels that get covered later).
+*/
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "image.h"
+
+class Rasterizer
+{
+public:
+	static const int TILE_SIZE = 64; // Tile side in pixels
+
+	Rasterizer();
+	~Rasterizer();
+
+	// Start a new frame: clears the bins and sets the targets for this frame
+	void Begin(Image* framebuffer, FloatImage* zbuffer);
+
+	// Store the triangle and add it to the bin of every tile its bounding box touches
+	void AddTriangle(const sTriangleInfo& triangle);
+
+	// Rasterize all the binned triangles (blocks until every tile is done)
+	void Flush();
+
+	int GetNumThreads() const { return (int)workers.size() + 1; } // Workers + main thread
+
+	// Two pass mode (depth + triangle id, then shading), gives the same image as the forward path
+	bool useVisibilityBuffer = false;
+
+	// Counters of the last Flush (summed over all the threads, a triangle counts once per tile it touches)
+	const sRasterStats& GetStats() const { return stats; }
+
+private:
+	Image* framebuffer = NULL;
+	FloatImage* zbuffer = NULL;
+
+	int tiles_x = 0;
+	int tiles_y = 0;
+
+	std::vector<sTriangleInfo> triangles;       // All the triangles of the frame (in submission order)
+	std::vector< std::vector<unsigned int> > bins; // Indices into triangles, one list per tile
+	std::vector<unsigned int> ids;              // Visibility buffer: triangle index + 1 per pixel (0 = empty)
+
+	// Thread pool
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	unsigned int frame_id = 0;   // Incremented on every Flush to wake the workers
+	int busy_workers = 0;
+	bool quit = false;
+	std::atomic<int> next_tile;
+
+	sRasterStats stats;
+
+	void WorkerLoop();
+	void RasterizeTiles();     // Grabs tiles until there are none left
+	void RasterizeTile(int tile, sRasterStats* tile_stats);
+};
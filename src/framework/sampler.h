@@ -0,0 +1,490 @@
+/*
+	+ Texture sampler used by the software rasterizer (DrawTriangleInterpolated).
+	+ Filters: nearest, bilinear (4 texels of one mip level) and trilinear (bilinear in the two
+	  closest mip levels, blended by the fractional LOD). Wrap modes: clamp to edge, repeat and mirror.
+	+ Every filter/wrap/format/layout combination is its own TSampler instantiation, so the inner loops
+	  have no branches on the sampler settings or on the texel layout (row-major or swizzled). Sampler::Setup picks the functions once per triangle and
+	  the rasterizer calls them through a pointer (one call per pixel or per 4 pixels).
+	+ Sample4 filters 4 pixels at once with SSE2 and gives exactly the same colors as Sample.
+	+ Block compressed textures are decoded on the fly, the colors of the last decoded blocks are
+	  kept so neighbour texels (bilinear footprints, next pixels) don't decode them again. The cache
+	  has a slot per parity of the block x, block y and level, so the (up to 4) blocks of a bilinear
+	  footprint and the two levels of trilinear never evict each other.
+	  Each thread has its own Sampler (it lives in the triangle setup), so the cache is not shared.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include "image.h"
+
+// Mip level for a footprint of rho texels per pixel (rho2 = rho^2): log2(rho) rounded to the
+// nearest level. rho2 in [2^(2k-1), 2^(2k+1)) is level k, so it comes straight from the float exponent.
+static inline int MipLevel(float rho2, int maxMip)
+{
+	if (!(rho2 > 1.0f)) // magnified (or degenerate): full resolution
+		return 0;
+
+	int bits;
+	memcpy(&bits, &rho2, sizeof(bits));
+	int exponent = ((bits >> 23) & 255) - 127;
+	return std::min((exponent + 1) >> 1, maxMip);
+}
+
+template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP, bool COMPRESSED, bool SWIZZLED>
+struct TSampler;
+
+class Sampler
+{
+public:
+	// Texture and settings of the triangle, called once per triangle
+	void Setup(const Image* texture, const sSamplerState& state);
+
+	bool HasMipmaps() const { return maxLevel > 0; }
+
+	// Color at (u, v). rho2 is the squared footprint of the pixel in level 0 texels (0 without mipmaps)
+	Color Sample(float u, float v, float rho2) const { return sampleFn(*this, u, v, rho2); }
+
+#ifdef RASTER_SSE
+	// Same as Sample for the 4 lanes, only the lanes in mask are written to out[0..3]
+	void Sample4(__m128 u, __m128 v, __m128 rho2, int mask, Color* out) const { sample4Fn(*this, u, v, rho2, mask, out); }
+#endif
+
+private:
+	template <sSamplerState::eFilter, sSamplerState::eWrap, bool, bool> friend struct TSampler;
+
+	const Image* texture = NULL;
+	int maxLevel = 0;
+
+	// Specialized filter of the current settings
+	Color (*sampleFn)(const Sampler& s, float u, float v, float rho2) = NULL;
+#ifdef RASTER_SSE
+	void (*sample4Fn)(const Sampler& s, __m128 u, __m128 v, __m128 rho2, int mask, Color* out) = NULL;
+#endif
+
+	template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP, bool COMPRESSED, bool SWIZZLED>
+	void SetFunctions();
+	template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP>
+	void SetFunctions(bool compressed, bool swizzled);
+	template <sSamplerState::eFilter FILTER>
+	void SetFunctions(sSamplerState::eWrap wrap, bool compressed, bool swizzled);
+
+	// Last decoded blocks of a compressed texture, slot = (level & 1) * 4 + (block y & 1) * 2 + (block x & 1)
+	mutable const unsigned char* cachedBlock[8] = {};
+	mutable Color cachedColors[8][4];
+
+	// Texel x,y of a compressed level, block is the one that contains it
+	Color BlockTexel(const unsigned char* block, int levelSlot, unsigned int x, unsigned int y) const
+	{
+		int slot = (levelSlot << 2) | ((y >> 1) & 2) | ((x >> 2) & 1);
+		if (block != cachedBlock[slot])
+		{
+			Image::DecodeBlockColors(block, cachedColors[slot]);
+			cachedBlock[slot] = block;
+		}
+		return cachedColors[slot][Image::BlockIndex(block, x, y)];
+	}
+
+	// Scalar min/max/floor that behave like their SSE versions (NaN gives the second operand),
+	// so both paths get the same texels even for garbage uvs
+	static float Min(float a, float b) { return a < b ? a : b; }
+	static float Max(float a, float b) { return a > b ? a : b; }
+	static float Floor(float x)
+	{
+		x = Min(Max(x, -8388608.0f), 8388608.0f); // 2^23: bigger floats are already integers
+		float t = (float)(int)x;
+		return t > x ? t - 1.0f : t;
+	}
+
+	// Continuous LOD for trilinear: 0.5 * log2(rho2) in [0, maxLevel]. log2 uses the exponent plus
+	// a linear mantissa (good to ~0.09 of a level, only the blend weight depends on it)
+	float Lod(float rho2) const
+	{
+		if (!(rho2 > 1.0f))
+			return 0.0f;
+
+		int bits;
+		memcpy(&bits, &rho2, sizeof(bits));
+		float exponent = (float)(((bits >> 23) & 255) - 127);
+		bits = (bits & 0x007FFFFF) | 0x3F800000; // mantissa in [1, 2)
+		float mantissa;
+		memcpy(&mantissa, &bits, sizeof(mantissa));
+		return Min(0.5f * (exponent + (mantissa - 1.0f)), (float)maxLevel);
+	}
+
+#ifdef RASTER_SSE
+	// Mip level of each lane (the lanes of a 2x2 quad share it, so most of the time the 4 are the same)
+	struct sLevels4
+	{
+		int level[4];
+		const Image* mip[4];
+		__m128 width, height;
+	};
+
+	void SetupLevels4(sLevels4& l, __m128i level) const
+	{
+		int* lv = l.level;
+		_mm_storeu_si128((__m128i*)lv, level);
+		if (lv[0] == lv[1] && lv[0] == lv[2] && lv[0] == lv[3])
+		{
+			const Image* mip = texture->GetMipmap(lv[0]);
+			l.mip[0] = l.mip[1] = l.mip[2] = l.mip[3] = mip;
+			l.width = _mm_set1_ps((float)mip->width);
+			l.height = _mm_set1_ps((float)mip->height);
+			return;
+		}
+		for (int i = 0; i < 4; ++i)
+			l.mip[i] = texture->GetMipmap(lv[i]);
+		l.width = _mm_setr_ps((float)l.mip[0]->width, (float)l.mip[1]->width, (float)l.mip[2]->width, (float)l.mip[3]->width);
+		l.height = _mm_setr_ps((float)l.mip[0]->height, (float)l.mip[1]->height, (float)l.mip[2]->height, (float)l.mip[3]->height);
+	}
+
+	static __m128 Floor4(__m128 x)
+	{
+		x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-8388608.0f)), _mm_set1_ps(8388608.0f));
+		__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+		return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+	}
+
+	// MipLevel of the 4 lanes
+	__m128i MipLevel4(__m128 rho2) const
+	{
+		__m128i exponent = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(_mm_castps_si128(rho2), 23), _mm_set1_epi32(255)), _mm_set1_epi32(127));
+		__m128 level = _mm_min_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_add_epi32(exponent, _mm_set1_epi32(1)), 1)), _mm_set1_ps((float)maxLevel));
+		return _mm_cvttps_epi32(_mm_and_ps(level, _mm_cmpgt_ps(rho2, _mm_set1_ps(1.0f))));
+	}
+
+	__m128 Lod4(__m128 rho2) const
+	{
+		__m128i bits = _mm_castps_si128(rho2);
+		__m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(255)), _mm_set1_epi32(127)));
+		__m128 mantissa = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+		__m128 lod = _mm_min_ps(_mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(exponent, _mm_sub_ps(mantissa, _mm_set1_ps(1.0f)))), _mm_set1_ps((float)maxLevel));
+		return _mm_and_ps(lod, _mm_cmpgt_ps(rho2, _mm_set1_ps(1.0f)));
+	}
+#endif
+};
+
+// The filter for one combination of settings. The template parameters are constants, so the
+// compiler drops the code of the other modes (no per pixel branches on them). SWIZZLED is the
+// layout of the pixels, compressed textures use blocks and always have it false
+template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP, bool COMPRESSED, bool SWIZZLED>
+struct TSampler
+{
+	static Color Sample(const Sampler& s, float u, float v, float rho2)
+	{
+		if (FILTER == sSamplerState::NEAREST)
+		{
+			int level = MipLevel(rho2, s.maxLevel);
+			const Image* mip = s.texture->GetMipmap(level);
+			return Texel(s, mip, level & 1, (unsigned int)NearestCoord(u, (float)mip->width), (unsigned int)NearestCoord(v, (float)mip->height));
+		}
+
+		float r, g, b;
+		if (FILTER == sSamplerState::BILINEAR)
+			Bilinear(s, MipLevel(rho2, s.maxLevel), u, v, r, g, b);
+		else
+		{
+			float lod = s.Lod(rho2);
+			int level = (int)lod;
+			float frac = lod - (float)level;
+			Bilinear(s, level, u, v, r, g, b);
+
+			// Exactly on a level (or on the last one) the second one has no weight
+			float r1 = 0.0f, g1 = 0.0f, b1 = 0.0f;
+			if (frac != 0.0f)
+				Bilinear(s, level + 1, u, v, r1, g1, b1);
+			r = r + (r1 - r) * frac;
+			g = g + (g1 - g) * frac;
+			b = b + (b1 - b) * frac;
+		}
+		return Color(r + 0.5f, g + 0.5f, b + 0.5f);
+	}
+
+	// Texel x,y of a level (level parity in levelSlot)
+	static Color Texel(const Sampler& s, const Image* mip, int levelSlot, unsigned int x, unsigned int y)
+	{
+		if (!COMPRESSED)
+			return mip->pixels[mip->LayoutIndexX<SWIZZLED>(x) + mip->LayoutIndexY<SWIZZLED>(y)];
+		return s.BlockTexel(mip->GetBlock(x, y), levelSlot, x, y);
+	}
+
+	// The 2x2 texels of a bilinear footprint: (x0,y0), (x1,y0), (x0,y1), (x1,y1)
+	static void Texels2x2(const Sampler& s, const Image* mip, int slot, unsigned int x0, unsigned int x1, unsigned int y0, unsigned int y1, Color t[4])
+	{
+		if (COMPRESSED)
+		{
+			// Rows and columns of blocks computed once for the 4 texels
+			unsigned int blocksX = (mip->width + 3) >> 2;
+			const unsigned char* row0 = mip->blocks + (((y0 >> 2) * blocksX) << 3);
+			const unsigned char* row1 = mip->blocks + (((y1 >> 2) * blocksX) << 3);
+			unsigned int col0 = (x0 >> 2) << 3, col1 = (x1 >> 2) << 3;
+			t[0] = s.BlockTexel(row0 + col0, slot, x0, y0);
+			t[1] = s.BlockTexel(row0 + col1, slot, x1, y0);
+			t[2] = s.BlockTexel(row1 + col0, slot, x0, y1);
+			t[3] = s.BlockTexel(row1 + col1, slot, x1, y1);
+			return;
+		}
+		unsigned int ix0 = mip->LayoutIndexX<SWIZZLED>(x0), ix1 = mip->LayoutIndexX<SWIZZLED>(x1);
+		unsigned int iy0 = mip->LayoutIndexY<SWIZZLED>(y0), iy1 = mip->LayoutIndexY<SWIZZLED>(y1);
+		t[0] = mip->pixels[ix0 + iy0];
+		t[1] = mip->pixels[ix1 + iy0];
+		t[2] = mip->pixels[ix0 + iy1];
+		t[3] = mip->pixels[ix1 + iy1];
+	}
+
+	// Repeat keeps the fractional part. Mirror folds u into [0, 1] (period 2), after that the
+	// edges work like clamp since the texel on the other side of the mirror line is the same one.
+	// 2 - u is exact for u in [1, 2), so uvs already in [0, 1] give the same texels as clamp
+	static float WrapCoord(float u)
+	{
+		if (WRAP == sSamplerState::REPEAT)
+			u = u - Sampler::Floor(u);
+		else if (WRAP == sSamplerState::MIRROR)
+		{
+			u = u - 2.0f * Sampler::Floor(u * 0.5f);
+			u = u > 1.0f ? 2.0f - u : u;
+		}
+		return u;
+	}
+
+	// Texel index (as float) of the nearest filter along one axis of a level of the given size
+	static float NearestCoord(float u, float size)
+	{
+		u = WrapCoord(u);
+		return Sampler::Floor(Sampler::Min(Sampler::Max(u * size, 0.0f), size - 1.0f));
+	}
+
+	// The two texels and the weight of the second one along one axis (texel centers are at +0.5)
+	static void BilinearCoords(float u, float size, int& i0, int& i1, float& frac)
+	{
+		u = WrapCoord(u);
+
+		float t = u * size - 0.5f;
+		float t0 = Sampler::Floor(t);
+		float t1 = t0 + 1.0f;
+		frac = t - t0;
+
+		if (WRAP == sSamplerState::REPEAT)
+		{
+			t0 = t0 < 0.0f ? t0 + size : t0;
+			t1 = t1 >= size ? t1 - size : t1;
+		}
+		i0 = (int)Sampler::Min(Sampler::Max(t0, 0.0f), size - 1.0f);
+		i1 = (int)Sampler::Min(Sampler::Max(t1, 0.0f), size - 1.0f);
+	}
+
+	static void Bilinear(const Sampler& s, int level, float u, float v, float& r, float& g, float& b)
+	{
+		const Image* mip = s.texture->GetMipmap(level);
+		int x0, x1, y0, y1;
+		float fx, fy;
+		BilinearCoords(u, (float)mip->width, x0, x1, fx);
+		BilinearCoords(v, (float)mip->height, y0, y1, fy);
+
+		Color c[4];
+		Texels2x2(s, mip, level & 1, x0, x1, y0, y1, c);
+
+		auto lerp2 = [&](float a00, float a10, float a01, float a11) {
+			float top = a00 + (a10 - a00) * fx;
+			float bottom = a01 + (a11 - a01) * fx;
+			return top + (bottom - top) * fy;
+		};
+		r = lerp2(c[0].r, c[1].r, c[2].r, c[3].r);
+		g = lerp2(c[0].g, c[1].g, c[2].g, c[3].g);
+		b = lerp2(c[0].b, c[1].b, c[2].b, c[3].b);
+	}
+
+#ifdef RASTER_SSE
+	static void Sample4(const Sampler& s, __m128 u, __m128 v, __m128 rho2, int mask, Color* out)
+	{
+		Sampler::sLevels4 levels;
+
+		if (FILTER == sSamplerState::NEAREST)
+		{
+			s.SetupLevels4(levels, s.MipLevel4(rho2));
+
+			int tx[4], ty[4];
+			_mm_storeu_si128((__m128i*)tx, _mm_cvttps_epi32(NearestCoord4(u, levels.width)));
+			_mm_storeu_si128((__m128i*)ty, _mm_cvttps_epi32(NearestCoord4(v, levels.height)));
+			for (int i = 0; i < 4; ++i)
+				if (mask & (1 << i))
+					out[i] = Texel(s, levels.mip[i], levels.level[i] & 1, tx[i], ty[i]);
+			return;
+		}
+
+		__m128 r, g, b;
+		if (FILTER == sSamplerState::BILINEAR)
+		{
+			s.SetupLevels4(levels, s.MipLevel4(rho2));
+			Bilinear4(s, levels, u, v, mask, r, g, b);
+		}
+		else
+		{
+			__m128 lod = s.Lod4(rho2);
+			__m128i level = _mm_cvttps_epi32(lod);
+			__m128 frac = _mm_sub_ps(lod, _mm_cvtepi32_ps(level));
+			s.SetupLevels4(levels, level);
+			Bilinear4(s, levels, u, v, mask, r, g, b);
+
+			// Lanes exactly on a level don't need the second one (no weight, same as the scalar path).
+			// The others are below maxLevel, so level + 1 exists
+			int mask1 = mask & ~_mm_movemask_ps(_mm_cmpeq_ps(frac, _mm_setzero_ps()));
+			if (mask1)
+			{
+				__m128 r1, g1, b1;
+				s.SetupLevels4(levels, _mm_add_epi32(level, _mm_and_si128(_mm_castps_si128(_mm_cmpneq_ps(frac, _mm_setzero_ps())), _mm_set1_epi32(1))));
+				Bilinear4(s, levels, u, v, mask1, r1, g1, b1);
+				r = _mm_add_ps(r, _mm_mul_ps(_mm_sub_ps(r1, r), frac));
+				g = _mm_add_ps(g, _mm_mul_ps(_mm_sub_ps(g1, g), frac));
+				b = _mm_add_ps(b, _mm_mul_ps(_mm_sub_ps(b1, b), frac));
+			}
+		}
+
+		const __m128 half = _mm_set1_ps(0.5f);
+		int cr[4], cg[4], cb[4];
+		_mm_storeu_si128((__m128i*)cr, _mm_cvttps_epi32(_mm_add_ps(r, half)));
+		_mm_storeu_si128((__m128i*)cg, _mm_cvttps_epi32(_mm_add_ps(g, half)));
+		_mm_storeu_si128((__m128i*)cb, _mm_cvttps_epi32(_mm_add_ps(b, half)));
+		for (int i = 0; i < 4; ++i)
+		{
+			if (mask & (1 << i))
+			{
+				out[i].r = (unsigned char)cr[i];
+				out[i].g = (unsigned char)cg[i];
+				out[i].b = (unsigned char)cb[i];
+			}
+		}
+	}
+
+	// WrapCoord of the 4 lanes
+	static __m128 WrapCoord4(__m128 u)
+	{
+		if (WRAP == sSamplerState::REPEAT)
+			u = _mm_sub_ps(u, Sampler::Floor4(u));
+		else if (WRAP == sSamplerState::MIRROR)
+		{
+			const __m128 two = _mm_set1_ps(2.0f);
+			u = _mm_sub_ps(u, _mm_mul_ps(two, Sampler::Floor4(_mm_mul_ps(u, _mm_set1_ps(0.5f)))));
+			__m128 back = _mm_cmpgt_ps(u, _mm_set1_ps(1.0f));
+			u = _mm_or_ps(_mm_and_ps(back, _mm_sub_ps(two, u)), _mm_andnot_ps(back, u));
+		}
+		return u;
+	}
+
+	static __m128 NearestCoord4(__m128 u, __m128 size)
+	{
+		u = WrapCoord4(u);
+		return Sampler::Floor4(_mm_min_ps(_mm_max_ps(_mm_mul_ps(u, size), _mm_setzero_ps()), _mm_sub_ps(size, _mm_set1_ps(1.0f))));
+	}
+
+	static void BilinearCoords4(__m128 u, __m128 size, __m128i& i0, __m128i& i1, __m128& frac)
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		u = WrapCoord4(u);
+
+		__m128 t = _mm_sub_ps(_mm_mul_ps(u, size), _mm_set1_ps(0.5f));
+		__m128 t0 = Sampler::Floor4(t);
+		__m128 t1 = _mm_add_ps(t0, one);
+		frac = _mm_sub_ps(t, t0);
+
+		if (WRAP == sSamplerState::REPEAT)
+		{
+			t0 = _mm_add_ps(t0, _mm_and_ps(_mm_cmplt_ps(t0, zero), size));
+			t1 = _mm_sub_ps(t1, _mm_and_ps(_mm_cmpge_ps(t1, size), size));
+		}
+		__m128 last = _mm_sub_ps(size, one);
+		i0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(t0, zero), last));
+		i1 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(t1, zero), last));
+	}
+
+	// Bilinear of the 4 lanes, each one in its own level. The texel addresses and the blend are
+	// done 4 at a time, only the 16 texel loads are scalar (no gather in SSE2)
+	static void Bilinear4(const Sampler& s, const Sampler::sLevels4& levels, __m128 u, __m128 v, int mask, __m128& r, __m128& g, __m128& b)
+	{
+		__m128i x0, x1, y0, y1;
+		__m128 fx, fy;
+		BilinearCoords4(u, levels.width, x0, x1, fx);
+		BilinearCoords4(v, levels.height, y0, y1, fy);
+
+		int ix0[4], ix1[4], iy0[4], iy1[4];
+		_mm_storeu_si128((__m128i*)ix0, x0);
+		_mm_storeu_si128((__m128i*)ix1, x1);
+		_mm_storeu_si128((__m128i*)iy0, y0);
+		_mm_storeu_si128((__m128i*)iy1, y1);
+
+		// [lane][texel], the lanes out of the mask stay black
+		Color t[4][4];
+		for (int i = 0; i < 4; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+			Texels2x2(s, levels.mip[i], levels.level[i] & 1, ix0[i], ix1[i], iy0[i], iy1[i], t[i]);
+		}
+
+		// One channel of one texel of the 4 lanes (built in registers, a 16 byte load of
+		// values just written one by one would stall on store forwarding)
+		#define TEXEL4(k, ch) _mm_cvtepi32_ps(_mm_setr_epi32(t[0][k].ch, t[1][k].ch, t[2][k].ch, t[3][k].ch))
+		auto lerp2 = [&](__m128 a00, __m128 a10, __m128 a01, __m128 a11) {
+			__m128 top = _mm_add_ps(a00, _mm_mul_ps(_mm_sub_ps(a10, a00), fx));
+			__m128 bottom = _mm_add_ps(a01, _mm_mul_ps(_mm_sub_ps(a11, a01), fx));
+			return _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), fy));
+		};
+		r = lerp2(TEXEL4(0, r), TEXEL4(1, r), TEXEL4(2, r), TEXEL4(3, r));
+		g = lerp2(TEXEL4(0, g), TEXEL4(1, g), TEXEL4(2, g), TEXEL4(3, g));
+		b = lerp2(TEXEL4(0, b), TEXEL4(1, b), TEXEL4(2, b), TEXEL4(3, b));
+		#undef TEXEL4
+	}
+#endif
+};
+
+template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP, bool COMPRESSED, bool SWIZZLED>
+inline void Sampler::SetFunctions()
+{
+	sampleFn = &TSampler<FILTER, WRAP, COMPRESSED, SWIZZLED>::Sample;
+#ifdef RASTER_SSE
+	sample4Fn = &TSampler<FILTER, WRAP, COMPRESSED, SWIZZLED>::Sample4;
+#endif
+}
+
+template <sSamplerState::eFilter FILTER, sSamplerState::eWrap WRAP>
+inline void Sampler::SetFunctions(bool compressed, bool swizzled)
+{
+	// The layout doesn't matter for blocks, no need for a swizzled compressed version
+	if (compressed)
+		SetFunctions<FILTER, WRAP, true, false>();
+	else if (swizzled)
+		SetFunctions<FILTER, WRAP, false, true>();
+	else
+		SetFunctions<FILTER, WRAP, false, false>();
+}
+
+template <sSamplerState::eFilter FILTER>
+inline void Sampler::SetFunctions(sSamplerState::eWrap wrap, bool compressed, bool swizzled)
+{
+	switch (wrap)
+	{
+	case sSamplerState::REPEAT: SetFunctions<FILTER, sSamplerState::REPEAT>(compressed, swizzled); break;
+	case sSamplerState::MIRROR: SetFunctions<FILTER, sSamplerState::MIRROR>(compressed, swizzled); break;
+	default:                    SetFunctions<FILTER, sSamplerState::CLAMP>(compressed, swizzled); break;
+	}
+}
+
+inline void Sampler::Setup(const Image* texture, const sSamplerState& state)
+{
+	this->texture = texture;
+	maxLevel = texture->GetNumMipmaps() - 1;
+	for (int i = 0; i < 8; ++i)
+		cachedBlock[i] = NULL;
+
+	// All the levels have the same format and layout (Compress and SetSwizzled also change the mipmaps)
+	bool compressed = texture->IsCompressed();
+	bool swizzled = texture->swizzled;
+	switch (state.filter)
+	{
+	case sSamplerState::NEAREST:  SetFunctions<sSamplerState::NEAREST>(state.wrap, compressed, swizzled); break;
+	case sSamplerState::BILINEAR: SetFunctions<sSamplerState::BILINEAR>(state.wrap, compressed, swizzled); break;
+	default:                      SetFunctions<sSamplerState::TRILINEAR>(state.wrap, compressed, swizzled); break;
+	}
+}